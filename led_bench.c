@@ -0,0 +1,346 @@
+/*
+ * Userspace microbenchmark of the driver core against the simulated
+ * register block. Build with "make bench" and run ./led_bench [iterations].
+ */
+#include <stdlib.h>
+#include <time.h>
+
+#include "led_core.h"
+
+#define DEFAULT_ITERATIONS 200000
+
+static const char bench_batch[] =
+    "16:on\n20:off\n21:blink\nmask:0x310000:off\n"
+    "16:off;20:on;21:on;mask:0x110000:on\n"
+    "16:toggle;mask:0x300000:toggle;query\n";
+
+static double now_sec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long ops, const char *unit, double elapsed) {
+    printf("%-8s %10lu %-5s in %7.3f s  %12.0f %s/s\n",
+           name, ops, unit, elapsed, ops / elapsed, unit);
+}
+
+static void bench_parse(unsigned long iterations) {
+    struct led_cmd cmds[MAX_BATCH_CMDS];
+    char input[sizeof(bench_batch)];
+    char error[256];
+    unsigned long total = 0;
+    unsigned int count;
+    unsigned long i;
+    double start;
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        // parse_input() splits the buffer in place
+        memcpy(input, bench_batch, sizeof(bench_batch));
+        parse_input(input, sizeof(bench_batch) - 1, cmds, &count, error, sizeof(error));
+        total += count;
+    }
+    report("parse", total, "cmds", now_sec() - start);
+}
+
+static void bench_apply(unsigned long iterations) {
+    struct led_cmd cmds[MAX_BATCH_CMDS];
+    char input[sizeof(bench_batch)];
+    char error[256];
+    struct led_update update;
+    unsigned int count;
+    unsigned long i;
+    double start;
+
+    memcpy(input, bench_batch, sizeof(bench_batch));
+    parse_input(input, sizeof(bench_batch) - 1, cmds, &count, error, sizeof(error));
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        fold_commands(cmds, count, &update);
+        gpio_update_mask_toggle(update.set, update.clear, update.toggle);
+    }
+    report("apply", iterations * count, "cmds", now_sec() - start);
+}
+
+/*
+ * Plays a ping-pong chaser over the three pins on simulated time, applying
+ * every keyframe the way the driver's timeline timer does.
+ */
+static void bench_timeline(unsigned long iterations) {
+    struct led_keyframe frames[] = {
+        { .at_us = 0, .mask = BIT(16) | BIT(20) | BIT(21), .levels = BIT(16) },
+        { .at_us = 100000, .mask = BIT(16) | BIT(20), .levels = BIT(20) },
+        { .at_us = 200000, .mask = BIT(20) | BIT(21), .levels = BIT(21) },
+        { .at_us = 300000, .mask = BIT(21), .levels = 0 },
+    };
+    struct led_timeline timeline = {
+        .mode = LED_TIMELINE_PINGPONG,
+        .length_us = 400000,
+        .count = 4,
+    };
+    const struct led_keyframe *frame;
+    struct led_player player;
+    u64 next;
+    unsigned long i;
+    double start;
+
+    if (led_timeline_check(&timeline, frames)) {
+        printf("timeline rejected\n");
+        return;
+    }
+
+    led_player_start(&player, &timeline, frames, 1);
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        frame = led_player_step(&player, &next);
+        gpio_update_mask(frame->levels, frame->mask & ~frame->levels);
+    }
+    report("timeline", iterations, "frames", now_sec() - start);
+}
+
+/*
+ * Runs a looping program over the three pins on simulated time, writing
+ * what each run changes the way the driver's pattern timer does.
+ */
+static void bench_program(unsigned long iterations) {
+    struct led_insn insns[] = {
+        { .op = LED_OP_SET, .arg = BIT(16) },
+        { .op = LED_OP_WAIT, .arg = 100000 },
+        { .op = LED_OP_CLEAR, .arg = BIT(16) },
+        { .op = LED_OP_SET, .arg = BIT(20) | BIT(21) },
+        { .op = LED_OP_WAIT, .arg = 100000 },
+        { .op = LED_OP_CLEAR, .arg = BIT(20) | BIT(21) },
+        { .op = LED_OP_LOOP, .arg = 0, .count = 3 },
+        { .op = LED_OP_WAIT, .arg = 500000 },
+        { .op = LED_OP_JUMP, .arg = 0 },
+    };
+    unsigned int count = sizeof(insns) / sizeof(insns[0]);
+    struct led_vm vm;
+    u32 set, clear;
+    unsigned long i;
+    double start;
+
+    if (led_program_check(insns, count)) {
+        printf("program rejected\n");
+        return;
+    }
+
+    led_vm_start(&vm, insns, count, 1);
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        led_vm_run(&vm, &set, &clear);
+        gpio_update_mask(set, clear);
+    }
+    report("program", iterations, "runs", now_sec() - start);
+}
+
+static void bench_blink(unsigned long iterations) {
+    struct led_blink_sched sched = { 0 };
+    unsigned long cycles_before = led_stats_read(blink_cycles);
+    u64 now = 1;
+    unsigned long i;
+    double start;
+
+    led_blink_start(&sched, 16, 500, 50, 0, now);
+    led_blink_start(&sched, 20, 250, 50, 0, now);
+    led_blink_start(&sched, 21, 125, 20, 0, now);
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        now = led_blink_run(&sched, now);
+    }
+    report("blink", iterations, "ticks", now_sec() - start);
+    printf("%-8s %10llu blink cycles in %lu ticks\n", "blink",
+           led_stats_read(blink_cycles) - cycles_before, iterations);
+}
+
+/*
+ * Checks that one advance over several ticks hands out events in the
+ * order they were due, so folding them lets the later event win: across
+ * ticks, within one tick, and between events with the same deadline.
+ */
+static void check_wheel_order(void) {
+    static const struct {
+        u64 expires;
+        u32 set, clear;
+    } events[] = {
+        { 200000, 0, BIT(16) },         // off after on, added first
+        { 100000, BIT(16), 0 },
+        { 300010, BIT(20), 0 },         // same tick, later deadline wins
+        { 300005, 0, BIT(20) },
+        { 500000, BIT(21), 0 },         // same deadline, later add wins
+        { 500000, 0, BIT(21) },
+    };
+    struct led_wheel_entry entries[sizeof(events) / sizeof(events[0])] = { 0 };
+    struct led_wheel_entry *entry;
+    struct led_wheel *wheel;
+    struct hlist_head expired;
+    struct hlist_node *tmp;
+    u32 set = 0, clear = 0;
+    unsigned int i;
+
+    wheel = malloc(sizeof(*wheel));
+    if (!wheel) {
+        perror("malloc");
+        exit(1);
+    }
+    led_wheel_init(wheel, 0);
+    for (i = 0; i < sizeof(events) / sizeof(events[0]); i++) {
+        entries[i].expires = events[i].expires;
+        entries[i].set = events[i].set;
+        entries[i].clear = events[i].clear;
+        led_wheel_add(wheel, &entries[i]);
+    }
+
+    INIT_HLIST_HEAD(&expired);
+    led_wheel_advance(wheel, 1000000, &expired);
+    hlist_for_each_entry_safe(entry, tmp, &expired, node) {
+        set = (set & ~entry->clear) | entry->set;
+        clear = (clear & ~entry->set) | entry->clear;
+    }
+    free(wheel);
+
+    if (set != BIT(20) || clear != (BIT(16) | BIT(21))) {
+        fprintf(stderr, "wheel order: set=0x%08x clear=0x%08x, expected 0x%08lx 0x%08lx\n",
+                set, clear, BIT(20), BIT(16) | BIT(21));
+        exit(1);
+    }
+    printf("%-8s order ok\n", "wheel");
+}
+
+/*
+ * Schedules count events for as many virtual LEDs, spread over one second
+ * and mapped onto the three real pins, then plays them back the way the
+ * driver's timer does and cancels a second batch. Reports insert, fire
+ * and cancel rates and the cost of every timer expiry.
+ */
+static void bench_wheel(unsigned int count) {
+    static const u32 pins[] = { BIT(16), BIT(20), BIT(21) };
+    struct led_wheel_entry *entries, *entry;
+    struct led_wheel *wheel;
+    struct hlist_head expired;
+    struct hlist_node *tmp;
+    unsigned long fired = 0, wakeups = 0;
+    u64 seed = 1, now = 1, next;
+    u32 set, clear;
+    unsigned int i;
+    double start, elapsed;
+
+    wheel = malloc(sizeof(*wheel));
+    entries = calloc(count, sizeof(*entries));
+    if (!wheel || !entries) {
+        perror("malloc");
+        exit(1);
+    }
+    led_wheel_init(wheel, now);
+    printf("%-8s %10u virtual LEDs\n", "wheel", count);
+
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+        entries[i].expires = now + (seed >> 34) % NSEC_PER_SEC;
+        if (i & 1) {
+            entries[i].clear = pins[i % 3];
+        } else {
+            entries[i].set = pins[i % 3];
+        }
+        led_wheel_add(wheel, &entries[i]);
+    }
+    report("wheel", count, "adds", now_sec() - start);
+
+    start = now_sec();
+    while ((next = led_wheel_next(wheel))) {
+        now = next;
+        INIT_HLIST_HEAD(&expired);
+        fired += led_wheel_advance(wheel, now, &expired);
+        set = 0;
+        clear = 0;
+        hlist_for_each_entry_safe(entry, tmp, &expired, node) {
+            set = (set & ~entry->clear) | entry->set;
+            clear = (clear & ~entry->set) | entry->clear;
+            hlist_del_init(&entry->node);
+        }
+        gpio_update_mask(set, clear);
+        wakeups++;
+    }
+    elapsed = now_sec() - start;
+    report("wheel", fired, "fires", elapsed);
+    printf("%-8s %10lu wakeups, %.0f ns each\n", "wheel", wakeups, elapsed * 1e9 / wakeups);
+
+    for (i = 0; i < count; i++) {
+        entries[i].expires = now + NSEC_PER_SEC / count * i;
+        led_wheel_add(wheel, &entries[i]);
+    }
+    start = now_sec();
+    for (i = 0; i < count; i++) {
+        led_wheel_del(wheel, &entries[i]);
+    }
+    report("wheel", count, "dels", now_sec() - start);
+
+    free(entries);
+    free(wheel);
+}
+
+/*
+ * Steps three PWM channels on simulated time, jumping straight to each
+ * programmed edge. Every run is one timer expiry in the driver.
+ */
+static void bench_pwm(unsigned long iterations) {
+    struct led_pwm_sched sched = { 0 };
+    unsigned long edges_before = led_stats_read(pwm_edges);
+    u64 now = 1;
+    unsigned long i;
+    double start;
+
+    led_pwm_start(&sched, 16, 250, 1000, now);
+    led_pwm_start(&sched, 20, 500, 1500, now);
+    led_pwm_start(&sched, 21, 750, 2000, now);
+
+    start = now_sec();
+    for (i = 0; i < iterations; i++) {
+        now = led_pwm_run(&sched, now);
+    }
+    report("pwm", iterations, "runs", now_sec() - start);
+    printf("%-8s %10llu edge sets for %lu runs\n", "pwm",
+           led_stats_read(pwm_edges) - edges_before, iterations);
+}
+
+int main(int argc, char **argv) {
+    unsigned long iterations = DEFAULT_ITERATIONS;
+
+    if (argc > 1) {
+        iterations = strtoul(argv[1], NULL, 0);
+    }
+
+    gpio = calloc(1, GPIO_MAPPED_REGION_SIZE);
+    if (!gpio) {
+        perror("calloc");
+        return 1;
+    }
+    gpio_simulated = true;
+    gpio_resync();
+
+    managed_pins = BIT(16) | BIT(20) | BIT(21);
+    set_gpio_direction_out_mask(managed_pins);
+
+    bench_parse(iterations);
+    bench_apply(iterations);
+    bench_timeline(iterations);
+    bench_program(iterations);
+    bench_blink(iterations);
+    check_wheel_order();
+    bench_wheel(1000);
+    bench_wheel(10000);
+    bench_wheel(50000);
+    bench_pwm(iterations);
+
+    printf("%-8s %10llu writes, %llu elided, %llu timeline cycles\n", "mmio",
+           led_stats_read(mmio_writes), led_stats_read(elided_writes),
+           led_stats_read(blink_cycles));
+
+    free((void *)gpio);
+    return 0;
+}
@@ -0,0 +1,184 @@
+/*
+ * Binary interface of the led-control character device.
+ *
+ * Pin masks cover GPIO bank 0, bit N selects GPIO pin N.
+ */
+#ifndef LED_CONTROL_H
+#define LED_CONTROL_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define LED_IOC_MAGIC 'l'
+
+/* Single pin argument of LED_IOC_SET, LED_IOC_CLEAR and LED_IOC_TOGGLE */
+struct led_pin {
+    __u32 pin;
+};
+
+/*
+ * Pins to drive high, drive low and invert, applied as one GPSET0 and one
+ * GPCLR0 write. The three masks must not overlap.
+ */
+struct led_mask {
+    __u32 set;
+    __u32 clear;
+    __u32 toggle;
+};
+
+/* State of the managed pins, levels as last driven by the driver */
+struct led_state {
+    __u32 managed;
+    __u32 levels;
+    __u32 blinking;
+};
+
+/* Blink pin for duration_ms milliseconds */
+struct led_pattern {
+    __u32 pin;
+    __u32 duration_ms;
+};
+
+/* Software PWM on pin, duty in permille (0-1000) of a period at freq_hz */
+struct led_pwm {
+    __u32 pin;
+    __u32 duty;
+    __u32 freq_hz;
+};
+
+/* Playback modes of a timeline */
+enum led_timeline_mode {
+    LED_TIMELINE_ONCE,
+    LED_TIMELINE_LOOP,
+    LED_TIMELINE_PINGPONG,
+};
+
+#define LED_TIMELINE_MAX_FRAMES 256
+
+/*
+ * One step of a timeline, at_us after the start of the cycle: the pins in
+ * mask take their bit in levels. Pins switched on are dimmed by software
+ * PWM if duty (permille) is between 1 and 999, 0 means full brightness.
+ */
+struct led_keyframe {
+    __u32 at_us;
+    __u32 mask;
+    __u32 levels;
+    __u16 duty;
+    __u16 freq_hz;
+};
+
+/*
+ * Timeline of count keyframes at the user address frames, with strictly
+ * increasing at_us. LOOP repeats the keyframes every length_us, PINGPONG
+ * plays them forwards and then backwards with mirrored timing, a cycle
+ * lasting twice length_us. loops is the number of cycles, 0 for forever;
+ * ONCE plays a single pass. Starting a timeline stops any pattern on its
+ * pins, and a command for any of its pins stops the whole timeline.
+ */
+struct led_timeline {
+    __u32 mode;
+    __u32 loops;
+    __u32 length_us;
+    __u32 count;
+    __u64 frames;
+};
+
+/* Instructions of the pattern bytecode */
+enum led_opcode {
+    LED_OP_END,     /* stop the program */
+    LED_OP_SET,     /* drive the pins in arg high */
+    LED_OP_CLEAR,   /* drive the pins in arg low */
+    LED_OP_WAIT,    /* apply the pending changes, then wait arg microseconds */
+    LED_OP_LOOP,    /* run from instruction arg up to here count times in total */
+    LED_OP_JUMP,    /* continue at instruction arg */
+};
+
+#define LED_PROGRAM_MAX_INSNS 64
+
+struct led_insn {
+    __u8 op;
+    __u8 reserved;
+    __u16 count;
+    __u32 arg;
+};
+
+/*
+ * Program of count instructions at the user address insns, run by the
+ * driver on the pins it sets and clears. It is checked when loaded: the
+ * last instruction must be END or JUMP, LOOP must jump backwards, and
+ * every path that can repeat must pass a WAIT of at least 100 us. Pin
+ * ownership works as for timelines.
+ */
+struct led_program {
+    __u32 count;
+    __u32 reserved;
+    __u64 insns;
+};
+
+/*
+ * Level change scheduled for time_ns nanoseconds from now, or at time_ns
+ * of CLOCK_MONOTONIC with LED_SCHED_ABSOLUTE: the pins in set are driven
+ * high and those in clear low. id names the event for LED_IOC_UNSCHEDULE
+ * and must be unique among the pending events of the file; events still
+ * pending when the file is closed are dropped.
+ */
+#define LED_SCHED_ABSOLUTE 0x1
+
+struct led_sched_event {
+    __u64 id;
+    __u64 time_ns;
+    __u32 set;
+    __u32 clear;
+    __u32 flags;
+    __u32 reserved;
+};
+
+/*
+ * Command ring shared with the driver through mmap() at offset 0 of the
+ * device, one ring per open file. The producer fills cmds[head % LED_RING_ENTRIES]
+ * and then advances head; the driver applies entries in order, advances
+ * tail and counts malformed entries in rejected. Both indices run freely
+ * and wrap at 2^32. Entries are led_mask records with the same rules as
+ * LED_IOC_SET_MASK.
+ */
+#define LED_RING_ENTRIES 256
+
+struct led_ring {
+    __u32 head;
+    __u32 tail;
+    __u32 rejected;
+    __u32 reserved;
+    struct led_mask cmds[LED_RING_ENTRIES];
+};
+
+/*
+ * Desired state page, mapped at LED_MMAP_FRAME_OFFSET and shared by all
+ * clients. The writer makes seq odd, updates levels and mask, then makes
+ * seq even again. At every frame the driver drives the pins in mask to
+ * their bit in levels if seq has changed since the last applied frame.
+ */
+#define LED_MMAP_FRAME_OFFSET 0x10000
+
+struct led_frame {
+    __u32 seq;
+    __u32 levels;
+    __u32 mask;
+    __u32 reserved;
+};
+
+#define LED_IOC_SET_MASK _IOW(LED_IOC_MAGIC, 1, struct led_mask)
+#define LED_IOC_SET _IOW(LED_IOC_MAGIC, 2, struct led_pin)
+#define LED_IOC_CLEAR _IOW(LED_IOC_MAGIC, 3, struct led_pin)
+#define LED_IOC_TOGGLE _IOW(LED_IOC_MAGIC, 4, struct led_pin)
+#define LED_IOC_GET_STATE _IOR(LED_IOC_MAGIC, 5, struct led_state)
+#define LED_IOC_START_PATTERN _IOW(LED_IOC_MAGIC, 6, struct led_pattern)
+#define LED_IOC_RESYNC _IO(LED_IOC_MAGIC, 7)
+#define LED_IOC_RING_KICK _IO(LED_IOC_MAGIC, 8)
+#define LED_IOC_SET_PWM _IOW(LED_IOC_MAGIC, 9, struct led_pwm)
+#define LED_IOC_PLAY_TIMELINE _IOW(LED_IOC_MAGIC, 10, struct led_timeline)
+#define LED_IOC_LOAD_PROGRAM _IOW(LED_IOC_MAGIC, 11, struct led_program)
+#define LED_IOC_SCHEDULE _IOW(LED_IOC_MAGIC, 12, struct led_sched_event)
+#define LED_IOC_UNSCHEDULE _IOW(LED_IOC_MAGIC, 13, __u64)
+
+#endif /* LED_CONTROL_H */
@@ -0,0 +1,1314 @@
+#include "led_core.h"
+
+#ifdef __KERNEL__
+#include "led_trace.h"
+#endif
+
+volatile unsigned int *gpio;
+u32 managed_pins;
+void (*gpio_levels_changed)(u32 pins);
+DEFINE_PER_CPU(struct led_stats, led_stats);
+
+#ifdef LED_CTRL_SIM
+bool gpio_simulated = true;
+#else
+bool gpio_simulated = false;
+#endif
+
+// Serializes the read-modify-write of the simulated level register
+static DEFINE_SPINLOCK(sim_lock);
+
+// Shadow copies of GPFSEL0-5 and of the driven output levels, so that
+// neither direction changes nor state queries need to read MMIO. The
+// lock keeps them in step with the register writes.
+static u32 shadow_fsel[GPIO_FSEL_REGS];
+static u32 shadow_levels;
+static DEFINE_SPINLOCK(shadow_lock);
+
+static void sim_gpio_write(unsigned int offset, u32 value);
+static u32 sim_gpio_output_mask(void);
+static u32 gpio_write_levels(u32 set, u32 clear, u32 toggle);
+static void led_wheel_insert(struct led_wheel *wheel, struct led_wheel_entry *entry);
+static bool led_wheel_before(const struct hlist_node *a, const struct hlist_node *b);
+static struct hlist_node *led_wheel_merge(struct hlist_node *a, struct hlist_node *b);
+static struct hlist_node *led_wheel_sort(struct hlist_head *list);
+static u64 led_wheel_next_tick(const struct led_wheel *wheel);
+static unsigned int led_program_succ(const struct led_insn *insns, unsigned int pc,
+                                     unsigned int *succ);
+static void led_stats_mmio(unsigned int offset, u32 value);
+
+u32 gpio_read(unsigned int offset) {
+    if (gpio_simulated) {
+        return gpio[offset / 4];
+    }
+
+    // Dividing by 4 converts the byte offset to a word offset
+    // (since each register is 4 bytes).
+    return ioread32(gpio + offset / 4);
+}
+
+void gpio_write(unsigned int offset, u32 value) {
+    trace_led_gpio_write(offset, value);
+    led_stats_mmio(offset, value);
+
+    if (gpio_simulated) {
+        sim_gpio_write(offset, value);
+        return;
+    }
+
+    iowrite32(value, gpio + offset / 4);
+}
+
+/*
+ * Models the BCM2837 register semantics on plain memory: GPSET0/GPCLR0 are
+ * write-only and change the level in GPLEV0, but only for output pins.
+ */
+static void sim_gpio_write(unsigned int offset, u32 value) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&sim_lock, flags);
+    switch (offset) {
+    case GPIO_SET_OFFSET:
+        gpio[GPIO_LEV_OFFSET / 4] |= value & sim_gpio_output_mask();
+        break;
+    case GPIO_CLR_OFFSET:
+        gpio[GPIO_LEV_OFFSET / 4] &= ~(value & sim_gpio_output_mask());
+        break;
+    case GPIO_LEV_OFFSET:
+        // Read-only on the real hardware
+        break;
+    default:
+        gpio[offset / 4] = value;
+        break;
+    }
+    spin_unlock_irqrestore(&sim_lock, flags);
+}
+
+static u32 sim_gpio_output_mask(void) {
+    u32 mask = 0;
+    int pin;
+
+    for (pin = 0; pin < GPIO_NUM_PINS; pin++) {
+        u32 fsel = gpio[GPIO_FSEL_OFFSET / 4 + pin / 10];
+
+        if (((fsel >> ((pin % 10) * 3)) & 7) == 1) {
+            mask |= BIT(pin);
+        }
+    }
+    return mask;
+}
+
+void gpio_update_mask(u32 set, u32 clear) {
+    gpio_update_mask_toggle(set, clear, 0);
+}
+
+/*
+ * Like gpio_update_mask(), but also inverts the pins in toggle. Their
+ * current level comes from the shadow, under the same lock as the write.
+ */
+void gpio_update_mask_toggle(u32 set, u32 clear, u32 toggle) {
+    u32 changed = gpio_write_levels(set, clear, toggle);
+
+    if (changed && gpio_levels_changed) {
+        gpio_levels_changed(changed);
+    }
+}
+
+/*
+ * Writes the levels and returns the pins that changed. Pins whose shadow
+ * level already matches the request are left out, and a register write
+ * that would be left without pins is skipped altogether.
+ */
+static u32 gpio_write_levels(u32 set, u32 clear, u32 toggle) {
+    unsigned long flags;
+    u32 redundant;
+    int elided = 0;
+
+    spin_lock_irqsave(&shadow_lock, flags);
+    set |= toggle & ~shadow_levels;
+    clear |= toggle & shadow_levels;
+
+    redundant = (set & shadow_levels) | (clear & ~shadow_levels);
+    if (redundant) {
+        if (set && !(set & ~shadow_levels)) {
+            elided++;
+        }
+        if (clear && !(clear & shadow_levels)) {
+            elided++;
+        }
+        set &= ~shadow_levels;
+        clear &= shadow_levels;
+        led_stats_elided(redundant, elided);
+    }
+
+    if (clear) {
+        gpio_write(GPIO_CLR_OFFSET, clear);
+    }
+    if (set) {
+        gpio_write(GPIO_SET_OFFSET, set);
+    }
+    shadow_levels = (shadow_levels & ~clear) | set;
+    spin_unlock_irqrestore(&shadow_lock, flags);
+
+    return set | clear;
+}
+
+void gpio_set(int pin) {
+    gpio_update_mask(BIT(pin), 0);
+}
+
+void gpio_clear(int pin) {
+    gpio_update_mask(0, BIT(pin));
+}
+
+/* Returns the driven output levels from the shadow, without MMIO */
+u32 gpio_get_levels(void) {
+    return READ_ONCE(shadow_levels);
+}
+
+/*
+ * Reloads the shadow registers from the hardware, for when something
+ * outside the driver may have changed them.
+ */
+void gpio_resync(void) {
+    unsigned long flags;
+    u32 changed;
+    int reg;
+
+    spin_lock_irqsave(&shadow_lock, flags);
+    for (reg = 0; reg < GPIO_FSEL_REGS; reg++) {
+        shadow_fsel[reg] = gpio_read(GPIO_FSEL_OFFSET + reg * 4);
+    }
+    changed = shadow_levels;
+    shadow_levels = gpio_read(GPIO_LEV_OFFSET);
+    changed ^= shadow_levels;
+    spin_unlock_irqrestore(&shadow_lock, flags);
+
+    if (changed && gpio_levels_changed) {
+        gpio_levels_changed(changed);
+    }
+}
+
+/*
+ * Configures every pin in mask as output, with one write per GPFSEL
+ * register rather than one read-modify-write per pin.
+ */
+void set_gpio_direction_out_mask(u32 mask) {
+    unsigned long flags;
+    int first;
+    int pin;
+
+    spin_lock_irqsave(&shadow_lock, flags);
+
+    // Each GPFSEL register holds the function of 10 pins
+    for (first = 0; first < GPIO_NUM_PINS; first += 10) {
+        unsigned int reg = GPIO_FSEL_OFFSET + (first / 10) * 4;
+        u32 *shadow = &shadow_fsel[first / 10];
+        u32 func_mask = 0;
+        u32 func_out = 0;
+        u32 pins = 0;
+        unsigned int value;
+
+        for (pin = first; pin < first + 10 && pin < GPIO_NUM_PINS; pin++) {
+            // Calculate the bit shift for the specific pin
+            int shift = (pin % 10) * 3;
+
+            if (mask & BIT(pin)) {
+                // The 3 function bits are set to '001' to select output
+                func_mask |= 7 << shift;
+                func_out |= 1 << shift;
+                pins |= BIT(pin);
+            }
+        }
+
+        if (!pins) {
+            continue;
+        }
+
+        // Take the current GPFSEL value from the shadow, replace the
+        // function bits and write modified value back
+        value = (*shadow & ~func_mask) | func_out;
+        *shadow = value;
+
+        trace_led_direction_out(reg, pins, value);
+        gpio_write(reg, value);
+    }
+
+    spin_unlock_irqrestore(&shadow_lock, flags);
+}
+
+const char *parse_command(const char *input, struct led_cmd *cmd) {
+    unsigned int mask, duty, freq, period, count;
+    const char *err;
+    char action[32];
+    int pin, n;
+    u64 at;
+
+    cmd->at = 0;
+
+    // "@<ns> command" applies an on or off command at an absolute time
+    if (input[0] == '@') {
+        if (sscanf(input, "@%llu %n", &at, &n) != 1 || !at || input[n] == '@') {
+            return "Invalid time";
+        }
+        err = parse_command(input + n, cmd);
+        if (err) {
+            return err;
+        }
+        if (cmd->action != LED_ACTION_ON && cmd->action != LED_ACTION_OFF) {
+            return "Action cannot be timed";
+        }
+        cmd->at = at;
+        return NULL;
+    }
+
+    if (strcmp(input, "query") == 0) {
+        cmd->mask = 0;
+        cmd->action = LED_ACTION_QUERY;
+        trace_led_command(cmd->mask, cmd->action);
+        return NULL;
+    }
+    if (strcmp(input, "stage") == 0 || strcmp(input, "commit") == 0) {
+        cmd->mask = 0;
+        cmd->action = input[0] == 's' ? LED_ACTION_STAGE : LED_ACTION_COMMIT;
+        trace_led_command(cmd->mask, cmd->action);
+        return NULL;
+    }
+
+    // Parse the input string
+    if (sscanf(input, "mask:%x:%31s", &mask, action) == 2) {
+        if (!mask) {
+            return "Empty pin mask";
+        }
+        cmd->mask = mask;
+    } else if (sscanf(input, "%d:%31s", &pin, action) == 2) {
+        if (pin < 0 || pin >= GPIO_NUM_PINS) {
+            return "Invalid pin";
+        }
+        cmd->mask = BIT(pin);
+    } else {
+        return "Invalid input format";
+    }
+
+    if (!gpio_pins_managed(cmd->mask)) {
+        return "Pin not managed";
+    }
+
+    if (strcmp(action, "on") == 0) {
+        cmd->action = LED_ACTION_ON;
+    } else if (strcmp(action, "off") == 0) {
+        cmd->action = LED_ACTION_OFF;
+    } else if (strcmp(action, "blink") == 0) {
+        cmd->action = LED_ACTION_BLINK;
+        cmd->args[0] = BLINK_PERIOD_MS;
+        cmd->args[1] = BLINK_DUTY_PCT;
+        cmd->args[2] = BLINK_COUNT;
+    } else if (sscanf(action, "blink:%u:%u:%u%n", &period, &duty, &count, &n) == 3 &&
+               !action[n]) {
+        if (period < BLINK_PERIOD_MIN_MS || period > BLINK_PERIOD_MAX_MS) {
+            return "Invalid blink period";
+        }
+        if (duty > 100) {
+            return "Invalid duty cycle";
+        }
+        cmd->action = LED_ACTION_BLINK;
+        cmd->args[0] = period;
+        cmd->args[1] = duty;
+        cmd->args[2] = count;
+    } else if (strcmp(action, "toggle") == 0) {
+        cmd->action = LED_ACTION_TOGGLE;
+    } else if (sscanf(action, "pwm:%u:%u%n", &duty, &freq, &n) == 2 && !action[n]) {
+        if (duty > PWM_DUTY_MAX) {
+            return "Invalid duty cycle";
+        }
+        if (freq == 0 || freq > PWM_FREQ_MAX) {
+            return "Invalid frequency";
+        }
+        cmd->action = LED_ACTION_PWM;
+        cmd->args[0] = duty;
+        cmd->args[1] = freq;
+    } else {
+        return "Unknown action";
+    }
+
+    trace_led_command(cmd->mask, cmd->action);
+    return NULL;
+}
+
+/*
+ * Parses a list of newline or semicolon separated commands into cmds,
+ * stopping at the first invalid one. Returns the number of bytes consumed,
+ * or -EINVAL if the very first command is invalid. On an invalid command
+ * a message naming it is written to error.
+ */
+ssize_t parse_input(char *input, size_t len, struct led_cmd *cmds,
+                    unsigned int *count, char *error, size_t error_size) {
+    char *pos = input;
+    char *end = input + len;
+
+    *count = 0;
+
+    while (pos < end) {
+        char *next = pos + strcspn(pos, CMD_SEPARATORS);
+        char *cmd;
+        const char *err;
+
+        // Batch is full, leave the rest for the next write()
+        if (*count == MAX_BATCH_CMDS) {
+            return pos - input;
+        }
+
+        if (next < end) {
+            *next++ = '\0';
+        }
+
+        cmd = strim(pos);
+        if (*cmd) {
+            err = parse_command(cmd, &cmds[*count]);
+            if (err) {
+                led_stats_rejected();
+                snprintf(error, error_size, "Command %u at offset %zu (\"%s\"): %s\n",
+                         *count + 1, (size_t)(cmd - input), cmd, err);
+                return *count ? pos - input : -EINVAL;
+            }
+            (*count)++;
+        }
+
+        pos = next;
+    }
+
+    return len;
+}
+
+/*
+ * Folds a batch into one update, with later commands overriding earlier
+ * ones for the same pin, so the whole batch costs at most one GPSET0 and
+ * one GPCLR0 write. A toggle after on/off flips that command, a toggle
+ * after a toggle cancels it.
+ */
+void fold_commands(const struct led_cmd *cmds, unsigned int count,
+                   struct led_update *update) {
+    unsigned int i;
+
+    memset(update, 0, sizeof(*update));
+
+    // Timed commands are left to the caller
+    for (i = 0; i < count; i++) {
+        if (!cmds[i].at) {
+            led_update_add(update, &cmds[i]);
+        }
+    }
+}
+
+/* Folds one more command into update, see fold_commands() */
+void led_update_add(struct led_update *update, const struct led_cmd *cmd) {
+    enum led_action action = cmd->action;
+    u32 mask = cmd->mask;
+    u32 bits;
+    int pin;
+    u32 set = update->set & mask;
+    u32 clear = update->clear & mask;
+    u32 toggle = update->toggle & mask;
+
+    update->set &= ~mask;
+    update->clear &= ~mask;
+    update->toggle &= ~mask;
+    update->blink &= ~mask;
+    update->pwm &= ~mask;
+
+    // The extremes of the duty cycle need no timer
+    if (action == LED_ACTION_PWM && cmd->args[0] == 0) {
+        action = LED_ACTION_OFF;
+    } else if (action == LED_ACTION_PWM && cmd->args[0] == PWM_DUTY_MAX) {
+        action = LED_ACTION_ON;
+    } else if (action == LED_ACTION_BLINK && cmd->args[1] == 0) {
+        action = LED_ACTION_OFF;
+    } else if (action == LED_ACTION_BLINK && cmd->args[1] == 100) {
+        action = LED_ACTION_ON;
+    }
+
+    switch (action) {
+    case LED_ACTION_ON:
+        update->set |= mask;
+        break;
+    case LED_ACTION_OFF:
+        update->clear |= mask;
+        break;
+    case LED_ACTION_BLINK:
+        update->blink |= mask;
+        for (bits = mask; bits; bits &= bits - 1) {
+            pin = __ffs(bits);
+            update->blink_period[pin] = cmd->args[0];
+            update->blink_duty[pin] = cmd->args[1];
+            update->blink_count[pin] = cmd->args[2];
+        }
+        break;
+    case LED_ACTION_TOGGLE:
+        update->set |= clear;
+        update->clear |= set;
+        update->toggle |= mask & ~(set | clear | toggle);
+        break;
+    case LED_ACTION_QUERY:
+        update->query = true;
+        break;
+    case LED_ACTION_STAGE:
+    case LED_ACTION_COMMIT:
+        // Switch the staging buffer of the file, handled by the caller
+        break;
+    case LED_ACTION_PWM:
+        update->pwm |= mask;
+        for (bits = mask; bits; bits &= bits - 1) {
+            pin = __ffs(bits);
+            update->pwm_duty[pin] = cmd->args[0];
+            update->pwm_freq[pin] = cmd->args[1];
+        }
+        break;
+    }
+}
+
+/*
+ * Validates a timeline before it is handed to a player, so playback never
+ * has to check anything. Returns an error message or NULL.
+ */
+const char *led_timeline_check(const struct led_timeline *timeline,
+                               const struct led_keyframe *frames) {
+    const struct led_keyframe *frame;
+    unsigned int i;
+
+    if (timeline->mode > LED_TIMELINE_PINGPONG) {
+        return "Invalid mode";
+    }
+    if (!timeline->count || timeline->count > LED_TIMELINE_MAX_FRAMES) {
+        return "Invalid keyframe count";
+    }
+    if (timeline->mode != LED_TIMELINE_ONCE && timeline->length_us < TIMELINE_MIN_CYCLE_US) {
+        return "Cycle too short";
+    }
+
+    for (i = 0; i < timeline->count; i++) {
+        frame = &frames[i];
+
+        if (i && frame->at_us <= frames[i - 1].at_us) {
+            return "Keyframes out of order";
+        }
+        if (timeline->mode != LED_TIMELINE_ONCE && frame->at_us >= timeline->length_us) {
+            return "Keyframe beyond the cycle";
+        }
+        if (frame->levels & ~frame->mask) {
+            return "Levels outside the mask";
+        }
+        if (!gpio_pins_managed(frame->mask)) {
+            return "Pin not managed";
+        }
+        if (frame->duty > PWM_DUTY_MAX) {
+            return "Invalid duty cycle";
+        }
+        if (frame->duty && frame->duty < PWM_DUTY_MAX &&
+            (!frame->freq_hz || frame->freq_hz > PWM_FREQ_MAX)) {
+            return "Invalid frequency";
+        }
+    }
+
+    if (!led_timeline_pins(frames, timeline->count)) {
+        return "No pins";
+    }
+    return NULL;
+}
+
+/* Returns every pin the timeline drives */
+u32 led_timeline_pins(const struct led_keyframe *frames, unsigned int count) {
+    u32 pins = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+        pins |= frames[i].mask;
+    }
+    return pins;
+}
+
+static u64 led_player_time(const struct led_player *player) {
+    u64 at = (u64)player->frames[player->index].at_us * NSEC_PER_USEC;
+
+    // The backward half of a ping-pong cycle mirrors the forward one
+    if (player->reverse) {
+        return player->base + 2 * player->length_ns - at;
+    }
+    return player->base + at;
+}
+
+/*
+ * Starts playing a checked timeline, taking over frames. Returns the time
+ * at which the first keyframe is due.
+ */
+u64 led_player_start(struct led_player *player, const struct led_timeline *timeline,
+                     struct led_keyframe *frames, u64 now) {
+    player->frames = frames;
+    player->count = timeline->count;
+    player->index = 0;
+    player->mode = timeline->mode;
+    player->loops = timeline->loops;
+    player->pins = led_timeline_pins(frames, timeline->count);
+    player->reverse = false;
+    player->length_ns = (u64)timeline->length_us * NSEC_PER_USEC;
+    player->base = now;
+
+    trace_led_timeline_start(player->pins, player->count, player->mode, player->loops);
+    return led_player_time(player);
+}
+
+/*
+ * Returns the keyframe that is due and moves on to the next one, whose
+ * time is stored in next, or 0 if the timeline has finished.
+ */
+const struct led_keyframe *led_player_step(struct led_player *player, u64 *next) {
+    const struct led_keyframe *frame = &player->frames[player->index];
+    unsigned int last = player->count - 1;
+    u32 pins;
+
+    if (!player->reverse && player->index < last) {
+        player->index++;
+    } else if (!player->reverse && player->mode == LED_TIMELINE_PINGPONG && last) {
+        // Turn around without repeating the last keyframe
+        player->reverse = true;
+        player->index = last - 1;
+    } else if (player->reverse && player->index > 0) {
+        player->index--;
+    } else {
+        // End of a cycle
+        this_cpu_inc(led_stats.blink_cycles);
+        for (pins = player->pins; pins; pins &= pins - 1) {
+            this_cpu_inc(led_stats.pin_blink_cycles[__ffs(pins)]);
+        }
+
+        if (player->mode == LED_TIMELINE_ONCE || (player->loops && --player->loops == 0)) {
+            trace_led_timeline_stop(player->pins, true);
+            *next = 0;
+            return frame;
+        }
+
+        player->base += player->mode == LED_TIMELINE_PINGPONG ?
+                        2 * player->length_ns : player->length_ns;
+
+        // A ping-pong cycle ends on the first keyframe, don't repeat it
+        player->index = player->reverse ? 1 : 0;
+        player->reverse = false;
+    }
+
+    *next = led_player_time(player);
+    return frame;
+}
+
+/*
+ * Validates a pattern program so that running it needs no checks. Besides
+ * the operands, the control flow graph with the edges out of WAIT removed
+ * must be acyclic: then every run ends at a WAIT or END after at most
+ * count instructions, and no loop can spin without time passing.
+ */
+const char *led_program_check(const struct led_insn *insns, unsigned int count) {
+    u8 indegree[LED_PROGRAM_MAX_INSNS] = { 0 };
+    u8 queue[LED_PROGRAM_MAX_INSNS];
+    unsigned int head = 0, tail = 0;
+    unsigned int pc, next, i;
+    unsigned int succ[2];
+    unsigned int nsucc;
+
+    if (!count || count > LED_PROGRAM_MAX_INSNS) {
+        return "Invalid program length";
+    }
+    if (insns[count - 1].op != LED_OP_END && insns[count - 1].op != LED_OP_JUMP) {
+        return "Program does not end with END or JUMP";
+    }
+
+    for (pc = 0; pc < count; pc++) {
+        const struct led_insn *insn = &insns[pc];
+
+        if (insn->reserved) {
+            return "Reserved field set";
+        }
+
+        switch (insn->op) {
+        case LED_OP_END:
+            break;
+        case LED_OP_SET:
+        case LED_OP_CLEAR:
+            if (!insn->arg || !gpio_pins_managed(insn->arg)) {
+                return "Pin not managed";
+            }
+            break;
+        case LED_OP_WAIT:
+            if (insn->arg < PROGRAM_MIN_WAIT_US) {
+                return "Wait too short";
+            }
+            break;
+        case LED_OP_LOOP:
+            if (insn->arg >= pc || !insn->count) {
+                return "Invalid loop";
+            }
+            break;
+        case LED_OP_JUMP:
+            if (insn->arg >= count) {
+                return "Jump out of the program";
+            }
+            break;
+        default:
+            return "Unknown instruction";
+        }
+    }
+
+    if (!led_program_pins(insns, count)) {
+        return "No pins";
+    }
+
+    // Kahn's algorithm: every instruction must be removable in
+    // topological order, otherwise there is a cycle without a WAIT
+    for (pc = 0; pc < count; pc++) {
+        nsucc = led_program_succ(insns, pc, succ);
+        for (i = 0; i < nsucc; i++) {
+            indegree[succ[i]]++;
+        }
+    }
+    for (pc = 0; pc < count; pc++) {
+        if (!indegree[pc]) {
+            queue[tail++] = pc;
+        }
+    }
+    while (head < tail) {
+        pc = queue[head++];
+        nsucc = led_program_succ(insns, pc, succ);
+        for (i = 0; i < nsucc; i++) {
+            next = succ[i];
+            if (--indegree[next] == 0) {
+                queue[tail++] = next;
+            }
+        }
+    }
+    if (tail != count) {
+        return "Loop without a WAIT";
+    }
+    return NULL;
+}
+
+/*
+ * Successors of pc within one run, i.e. without leaving a WAIT. The check
+ * guarantees pc + 1 exists for everything but END and JUMP.
+ */
+static unsigned int led_program_succ(const struct led_insn *insns, unsigned int pc,
+                                     unsigned int *succ) {
+    switch (insns[pc].op) {
+    case LED_OP_SET:
+    case LED_OP_CLEAR:
+        succ[0] = pc + 1;
+        return 1;
+    case LED_OP_LOOP:
+        succ[0] = insns[pc].arg;
+        succ[1] = pc + 1;
+        return 2;
+    case LED_OP_JUMP:
+        succ[0] = insns[pc].arg;
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Returns every pin the program drives */
+u32 led_program_pins(const struct led_insn *insns, unsigned int count) {
+    u32 pins = 0;
+    unsigned int pc;
+
+    for (pc = 0; pc < count; pc++) {
+        if (insns[pc].op == LED_OP_SET || insns[pc].op == LED_OP_CLEAR) {
+            pins |= insns[pc].arg;
+        }
+    }
+    return pins;
+}
+
+/*
+ * Starts a checked program, taking over insns. Returns the time of the
+ * first run, which is now.
+ */
+u64 led_vm_start(struct led_vm *vm, struct led_insn *insns, unsigned int count, u64 now) {
+    vm->insns = insns;
+    vm->count = count;
+    vm->pc = 0;
+    vm->pins = led_program_pins(insns, count);
+    vm->time = now;
+    memset(vm->counters, 0, sizeof(vm->counters));
+
+    trace_led_program_start(vm->pins, count);
+    return now;
+}
+
+/*
+ * Executes up to the next WAIT or END, collecting the level changes in set
+ * and clear for the caller to apply as one update. Returns the time of the
+ * next run, or 0 once the program has ended.
+ */
+u64 led_vm_run(struct led_vm *vm, u32 *set, u32 *clear) {
+    const struct led_insn *insn;
+
+    *set = 0;
+    *clear = 0;
+
+    for (;;) {
+        insn = &vm->insns[vm->pc];
+
+        switch (insn->op) {
+        case LED_OP_SET:
+            *set |= insn->arg;
+            *clear &= ~insn->arg;
+            vm->pc++;
+            break;
+        case LED_OP_CLEAR:
+            *clear |= insn->arg;
+            *set &= ~insn->arg;
+            vm->pc++;
+            break;
+        case LED_OP_WAIT:
+            vm->pc++;
+            vm->time += (u64)insn->arg * NSEC_PER_USEC;
+            return vm->time;
+        case LED_OP_LOOP:
+            // A counter of 0 means the loop is entered afresh
+            if (!vm->counters[vm->pc]) {
+                vm->counters[vm->pc] = insn->count;
+            }
+            if (--vm->counters[vm->pc]) {
+                vm->pc = insn->arg;
+            } else {
+                vm->pc++;
+            }
+            break;
+        case LED_OP_JUMP:
+            vm->pc = insn->arg;
+            break;
+        default:
+            trace_led_program_stop(vm->pins, true);
+            return 0;
+        }
+    }
+}
+
+/*
+ * Moves ch onto the edge of its cycle grid that follows now and returns
+ * the level the pin must have until then.
+ */
+static bool led_blink_align(struct led_blink_channel *ch, u64 now) {
+    u64 phase;
+
+    div64_u64_rem(now, ch->period_ns, &phase);
+    if (phase < ch->on_ns) {
+        ch->next = now - phase + ch->on_ns;
+        return true;
+    }
+    ch->next = now - phase + ch->period_ns;
+    return false;
+}
+
+/*
+ * Adds pin to the blink schedule, joining its cycle grid at now: a pin
+ * started during the on part of the current cycle lights at once, one
+ * started later waits dark for the next cycle. The caller drives the
+ * returned level, see led_blink_run().
+ */
+bool led_blink_start(struct led_blink_sched *sched, int pin, unsigned int period_ms,
+                     unsigned int duty_pct, unsigned int count, u64 now) {
+    struct led_blink_channel *ch = &sched->channels[pin];
+
+    ch->period_ns = (u64)period_ms * NSEC_PER_MSEC;
+    ch->on_ns = ch->period_ns / 100 * duty_pct;
+    ch->remaining = count;
+    ch->level = led_blink_align(ch, now);
+    sched->active |= BIT(pin);
+    trace_led_blink_start(BIT(pin), period_ms, duty_pct, count);
+    return ch->level;
+}
+
+/* Removes the pins in mask, leaving their level to the caller */
+void led_blink_stop_mask(struct led_blink_sched *sched, u32 mask) {
+    mask &= sched->active;
+    if (mask) {
+        sched->active &= ~mask;
+        trace_led_blink_stop(mask, false);
+    }
+}
+
+/* Returns the time of the earliest pending edge, or 0 if no pin blinks */
+u64 led_blink_next(const struct led_blink_sched *sched) {
+    u32 active = sched->active;
+    u64 next = 0;
+    int pin;
+
+    while (active) {
+        pin = __ffs(active);
+        if (!next || sched->channels[pin].next < next) {
+            next = sched->channels[pin].next;
+        }
+        active &= active - 1;
+    }
+    return next;
+}
+
+/*
+ * Applies every edge due by now, plus those within BLINK_EDGE_SLACK_NS
+ * after it, as one GPCLR0 and one GPSET0 write, and drops pins that have
+ * finished their cycles. Returns the time of the next edge, or 0 once no
+ * pin is left.
+ */
+u64 led_blink_run(struct led_blink_sched *sched, u64 now) {
+    u64 limit = now + BLINK_EDGE_SLACK_NS;
+    u32 active = sched->active;
+    u32 set = 0, clear = 0, done = 0;
+    struct led_blink_channel *ch;
+    int pin;
+
+    while (active) {
+        pin = __ffs(active);
+        active &= active - 1;
+        ch = &sched->channels[pin];
+
+        if (ch->next > limit) {
+            continue;
+        }
+
+        if (ch->level) {
+            clear |= BIT(pin);
+            ch->next += ch->period_ns - ch->on_ns;
+            this_cpu_inc(led_stats.blink_cycles);
+            this_cpu_inc(led_stats.pin_blink_cycles[pin]);
+
+            if (ch->remaining && --ch->remaining == 0) {
+                sched->active &= ~BIT(pin);
+                done |= BIT(pin);
+                continue;
+            }
+        } else {
+            set |= BIT(pin);
+            ch->next += ch->on_ns;
+        }
+        ch->level = !ch->level;
+
+        // More than a whole edge late: skip the missed edges, stay on the grid
+        if (ch->next <= now) {
+            if (led_blink_align(ch, now) != ch->level) {
+                set ^= BIT(pin);
+                clear ^= BIT(pin);
+                ch->level = !ch->level;
+            }
+        }
+    }
+
+    gpio_update_mask(set, clear);
+    if (done) {
+        trace_led_blink_stop(done, true);
+    }
+    return led_blink_next(sched);
+}
+
+void led_wheel_init(struct led_wheel *wheel, u64 now) {
+    unsigned int level, slot;
+
+    wheel->clk = now >> WHEEL_TICK_SHIFT;
+    wheel->seq = 0;
+    wheel->count = 0;
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        wheel->pending[level] = 0;
+        for (slot = 0; slot < WHEEL_SLOTS; slot++) {
+            INIT_HLIST_HEAD(&wheel->slots[level][slot]);
+        }
+    }
+}
+
+/*
+ * Files entry in the lowest level whose range covers it. Entries are
+ * rounded up to whole ticks so they never fire early; overdue ones go to
+ * the slot under clk, and those beyond the range park in the top level
+ * until it cascades them closer.
+ */
+static void led_wheel_insert(struct led_wheel *wheel, struct led_wheel_entry *entry) {
+    u64 tick = (entry->expires + BIT_ULL(WHEEL_TICK_SHIFT) - 1) >> WHEEL_TICK_SHIFT;
+    unsigned int level, slot;
+    u64 delta;
+
+    if (tick < wheel->clk) {
+        tick = wheel->clk;
+    }
+    delta = tick - wheel->clk;
+    if (delta >= WHEEL_RANGE) {
+        tick = wheel->clk + WHEEL_RANGE - 1;
+        delta = WHEEL_RANGE - 1;
+    }
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < BIT_ULL((level + 1) * WHEEL_LEVEL_BITS)) {
+            break;
+        }
+    }
+    slot = (tick >> (level * WHEEL_LEVEL_BITS)) & (WHEEL_SLOTS - 1);
+
+    entry->bucket = level * WHEEL_SLOTS + slot;
+    hlist_add_head(&entry->node, &wheel->slots[level][slot]);
+    wheel->pending[level] |= BIT_ULL(slot);
+}
+
+/* Schedules entry, whose node must be unhashed, in O(1) */
+void led_wheel_add(struct led_wheel *wheel, struct led_wheel_entry *entry) {
+    entry->seq = wheel->seq++;
+    led_wheel_insert(wheel, entry);
+    wheel->count++;
+}
+
+/* Cancels entry in O(1). Returns false if it was not scheduled. */
+bool led_wheel_del(struct led_wheel *wheel, struct led_wheel_entry *entry) {
+    unsigned int level = entry->bucket / WHEEL_SLOTS;
+    unsigned int slot = entry->bucket % WHEEL_SLOTS;
+
+    if (hlist_unhashed(&entry->node)) {
+        return false;
+    }
+
+    hlist_del_init(&entry->node);
+    if (hlist_empty(&wheel->slots[level][slot])) {
+        wheel->pending[level] &= ~BIT_ULL(slot);
+    }
+    wheel->count--;
+    return true;
+}
+
+/*
+ * Returns the first tick at which a level 0 slot expires or an upper slot
+ * must be cascaded. At the start of its span an upper slot is due at
+ * once, anywhere inside the span it holds entries of the next round.
+ */
+static u64 led_wheel_next_tick(const struct led_wheel *wheel) {
+    unsigned int level, shift, start;
+    u64 next = U64_MAX;
+    u64 base, tick;
+
+    for (level = 0; level < WHEEL_LEVELS; level++) {
+        if (!wheel->pending[level]) {
+            continue;
+        }
+
+        shift = level * WHEEL_LEVEL_BITS;
+        base = wheel->clk >> shift;
+        start = (wheel->clk & (BIT_ULL(shift) - 1)) ? 1 : 0;
+        tick = (base + start +
+                __ffs64(ror64(wheel->pending[level], (base + start) & (WHEEL_SLOTS - 1))))
+               << shift;
+        next = min(next, tick);
+    }
+    return next;
+}
+
+/* Returns when led_wheel_advance() next has work, or 0 if the wheel is empty */
+u64 led_wheel_next(const struct led_wheel *wheel) {
+    if (!wheel->count) {
+        return 0;
+    }
+    return led_wheel_next_tick(wheel) << WHEEL_TICK_SHIFT;
+}
+
+/* True if the entry at a is due before the one at b */
+static bool led_wheel_before(const struct hlist_node *a, const struct hlist_node *b) {
+    const struct led_wheel_entry *ea = hlist_entry(a, struct led_wheel_entry, node);
+    const struct led_wheel_entry *eb = hlist_entry(b, struct led_wheel_entry, node);
+
+    if (ea->expires != eb->expires) {
+        return ea->expires < eb->expires;
+    }
+    return ea->seq < eb->seq;
+}
+
+/* Merges two sorted chains linked through next only */
+static struct hlist_node *led_wheel_merge(struct hlist_node *a, struct hlist_node *b) {
+    struct hlist_node *head = NULL;
+    struct hlist_node **tail = &head;
+
+    while (a && b) {
+        if (led_wheel_before(b, a)) {
+            *tail = b;
+            b = b->next;
+        } else {
+            *tail = a;
+            a = a->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = a ? a : b;
+    return head;
+}
+
+/*
+ * Sorts list by deadline, then by scheduling order, with a bottom-up
+ * merge sort so a crowded slot costs O(n log n). runs[i] holds a sorted
+ * run of 2^i entries. Returns the last entry, or NULL if list is empty.
+ */
+static struct hlist_node *led_wheel_sort(struct hlist_head *list) {
+    struct hlist_node *runs[32] = { NULL };
+    struct hlist_node *node = list->first;
+    struct hlist_node *sorted = NULL;
+    struct hlist_node **pprev;
+    struct hlist_node *next;
+    unsigned int i;
+
+    while (node) {
+        next = node->next;
+        node->next = NULL;
+        for (i = 0; runs[i]; i++) {
+            node = led_wheel_merge(runs[i], node);
+            runs[i] = NULL;
+        }
+        runs[i] = node;
+        node = next;
+    }
+    for (i = 0; i < 32; i++) {
+        if (runs[i]) {
+            sorted = led_wheel_merge(runs[i], sorted);
+        }
+    }
+
+    // Restore the back links the merges left alone
+    list->first = sorted;
+    pprev = &list->first;
+    for (node = sorted; node; node = node->next) {
+        node->pprev = pprev;
+        pprev = &node->next;
+        sorted = node;
+    }
+    return sorted;
+}
+
+/*
+ * Processes every tick up to now, jumping straight between ticks with
+ * work. Expired entries are appended to expired in the order they were
+ * due, by deadline and then by scheduling order, so a caller folding them
+ * front to back lets the later event win. expired is for the caller to
+ * apply and release; returns how many entries were added.
+ */
+unsigned int led_wheel_advance(struct led_wheel *wheel, u64 now, struct hlist_head *expired) {
+    u64 now_tick = now >> WHEEL_TICK_SHIFT;
+    struct led_wheel_entry *entry;
+    unsigned int fired = 0;
+    unsigned int level, shift, slot;
+    struct hlist_node *tmp, *last;
+    struct hlist_head list;
+    u64 tick;
+
+    // New entries go after any the caller already has
+    last = NULL;
+    for (tmp = expired->first; tmp; tmp = tmp->next) {
+        last = tmp;
+    }
+
+    while (wheel->count && (tick = led_wheel_next_tick(wheel)) <= now_tick) {
+        wheel->clk = tick;
+
+        // Re-sort the upper slots whose span starts here, top down
+        for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+            shift = level * WHEEL_LEVEL_BITS;
+            slot = (tick >> shift) & (WHEEL_SLOTS - 1);
+            if ((tick & (BIT_ULL(shift) - 1)) || !(wheel->pending[level] & BIT_ULL(slot))) {
+                continue;
+            }
+
+            hlist_move_list(&wheel->slots[level][slot], &list);
+            wheel->pending[level] &= ~BIT_ULL(slot);
+            hlist_for_each_entry_safe(entry, tmp, &list, node) {
+                hlist_del_init(&entry->node);
+                led_wheel_insert(wheel, entry);
+            }
+        }
+
+        slot = tick & (WHEEL_SLOTS - 1);
+        if (wheel->pending[0] & BIT_ULL(slot)) {
+            hlist_move_list(&wheel->slots[0][slot], &list);
+            wheel->pending[0] &= ~BIT_ULL(slot);
+            hlist_for_each_entry_safe(entry, tmp, &list, node) {
+                wheel->count--;
+                fired++;
+            }
+
+            tmp = led_wheel_sort(&list);
+            if (last) {
+                last->next = list.first;
+                list.first->pprev = &last->next;
+            } else {
+                expired->first = list.first;
+                list.first->pprev = &expired->first;
+            }
+            last = tmp;
+        }
+        wheel->clk = tick + 1;
+    }
+
+    if (wheel->clk <= now_tick) {
+        wheel->clk = now_tick + 1;
+    }
+    return fired;
+}
+
+/*
+ * Adds pin to the PWM schedule with duty in permille of a period at
+ * freq_hz. The first rising edge is due at now.
+ */
+void led_pwm_start(struct led_pwm_sched *sched, int pin, unsigned int duty,
+                   unsigned int freq_hz, u64 now) {
+    struct led_pwm_channel *ch = &sched->channels[pin];
+    u32 period = NSEC_PER_SEC / freq_hz;
+
+    ch->on_ns = period / PWM_DUTY_MAX * duty;
+    ch->off_ns = period - ch->on_ns;
+    ch->next = now;
+    ch->level = false;
+    sched->active |= BIT(pin);
+}
+
+/* Removes the pins in mask, leaving their level to the caller */
+void led_pwm_stop_mask(struct led_pwm_sched *sched, u32 mask) {
+    sched->active &= ~mask;
+}
+
+/* Returns the time of the earliest pending edge, or 0 if no channel runs */
+u64 led_pwm_next(const struct led_pwm_sched *sched) {
+    u32 active = sched->active;
+    u64 next = 0;
+    int pin;
+
+    while (active) {
+        pin = __ffs(active);
+        if (!next || sched->channels[pin].next < next) {
+            next = sched->channels[pin].next;
+        }
+        active &= active - 1;
+    }
+    return next;
+}
+
+/*
+ * Applies every edge due by now, plus those within PWM_EDGE_SLACK_NS
+ * after it, as one GPCLR0 and one GPSET0 write. Returns the time of the
+ * next edge, or 0 once no channel is left.
+ *
+ * PWM edges bypass gpio_levels_changed, at kHz rates they are not events
+ * anyone wants to be woken for.
+ */
+u64 led_pwm_run(struct led_pwm_sched *sched, u64 now) {
+    u64 limit = now + PWM_EDGE_SLACK_NS;
+    u32 active = sched->active;
+    u32 set = 0, clear = 0;
+    struct led_pwm_channel *ch;
+    int pin;
+
+    while (active) {
+        pin = __ffs(active);
+        active &= active - 1;
+        ch = &sched->channels[pin];
+
+        if (ch->next > limit) {
+            continue;
+        }
+
+        if (ch->level) {
+            clear |= BIT(pin);
+            ch->next += ch->off_ns;
+        } else {
+            set |= BIT(pin);
+            ch->next += ch->on_ns;
+        }
+        ch->level = !ch->level;
+
+        // More than a whole edge late: drop the missed edges, restart the phase
+        if (ch->next <= now) {
+            ch->next = now + (ch->level ? ch->on_ns : ch->off_ns);
+        }
+    }
+
+    if (set | clear) {
+        gpio_write_levels(set, clear, 0);
+        this_cpu_inc(led_stats.pwm_edges);
+    }
+    return led_pwm_next(sched);
+}
+
+static void led_stats_mmio(unsigned int offset, u32 value) {
+    int pin;
+
+    this_cpu_inc(led_stats.mmio_writes);
+
+    if (offset != GPIO_SET_OFFSET && offset != GPIO_CLR_OFFSET) {
+        return;
+    }
+
+    while (value) {
+        pin = __ffs(value);
+        this_cpu_inc(led_stats.pin_mmio_writes[pin]);
+        value &= value - 1;
+    }
+}
+
+/* Counts one accepted command addressing the pins in mask */
+void led_stats_command(u32 mask) {
+    int pin;
+
+    this_cpu_inc(led_stats.commands_accepted);
+
+    while (mask) {
+        pin = __ffs(mask);
+        this_cpu_inc(led_stats.pin_commands[pin]);
+        mask &= mask - 1;
+    }
+}
+
+/* Counts pin updates and whole register writes skipped as redundant */
+void led_stats_elided(u32 pins, int writes) {
+    int pin;
+
+    this_cpu_add(led_stats.elided_writes, writes);
+
+    while (pins) {
+        pin = __ffs(pins);
+        this_cpu_inc(led_stats.pin_elided[pin]);
+        pins &= pins - 1;
+    }
+}
+
+void led_stats_rejected(void) {
+    this_cpu_inc(led_stats.commands_rejected);
+}
+
+void led_stats_latency(u64 ns) {
+    int bucket = fls64(ns);
+
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+    this_cpu_inc(led_stats.latency_hist[bucket]);
+}
+
+/* Records how late the PWM timer ran after its programmed edge */
+void led_stats_pwm_jitter(u64 ns) {
+    int bucket = fls64(ns);
+
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+    this_cpu_inc(led_stats.pwm_jitter_hist[bucket]);
+}
+
+/* Counts a scheduled event whose deadline had passed when it was queued */
+void led_stats_sched_missed(void) {
+    this_cpu_inc(led_stats.sched_missed);
+}
+
+/* Counts one fired scheduled event, ns after its deadline */
+void led_stats_sched_late(u64 ns) {
+    int bucket = fls64(ns);
+
+    if (bucket >= STATS_LATENCY_BUCKETS) {
+        bucket = STATS_LATENCY_BUCKETS - 1;
+    }
+    this_cpu_inc(led_stats.sched_fired);
+    this_cpu_inc(led_stats.sched_late_hist[bucket]);
+}
@@ -0,0 +1,323 @@
+/*
+ * Hardware independent core of the LED control driver: register access,
+ * command parsing, blink scheduling, timeline sequencing, pattern programs,
+ * software PWM and the timing wheel of scheduled events.
+ *
+ * The core is linked into the kernel module and, against led_shim.h, into
+ * userspace tools such as led_bench.
+ */
+#ifndef LED_CORE_H
+#define LED_CORE_H
+
+#ifdef __KERNEL__
+#include <linux/bitops.h>
+#include <linux/io.h>
+#include <linux/kernel.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/string.h>
+#include <linux/types.h>
+#else
+#include "led_shim.h"
+#endif
+
+#include "led_control.h"
+
+// I/O defines
+#define GPIO_BASE 0x3F200000
+#define GPIO_FSEL_OFFSET 0x00
+#define GPIO_SET_OFFSET 0x1C
+#define GPIO_CLR_OFFSET 0x28
+#define GPIO_LEV_OFFSET 0x34
+#define GPIO_MAPPED_REGION_SIZE 0xB0
+#define GPIO_NUM_PINS 32
+#define GPIO_FSEL_REGS 6
+
+// Blink defines, the defaults give 50 cycles of 100 ms
+#define BLINK_PERIOD_MS 100
+#define BLINK_DUTY_PCT 50
+#define BLINK_COUNT 50
+#define BLINK_PERIOD_MIN_MS 10
+#define BLINK_PERIOD_MAX_MS 3600000
+#define BLINK_EDGE_SLACK_NS 1000000
+
+// Shortest cycle of a repeating timeline
+#define TIMELINE_MIN_CYCLE_US 1000
+
+// Shortest wait of a pattern program
+#define PROGRAM_MIN_WAIT_US 100
+
+// Software PWM defines, duty is in permille
+#define PWM_DUTY_MAX 1000
+#define PWM_FREQ_MAX 10000
+#define PWM_EDGE_SLACK_NS 20000
+
+// Timing wheel defines: 5 levels of 64 slots over ticks of 2^14 ns (16 us)
+#define WHEEL_TICK_SHIFT 14
+#define WHEEL_LEVEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_LEVEL_BITS)
+#define WHEEL_LEVELS 5
+#define WHEEL_RANGE (1ULL << (WHEEL_LEVELS * WHEEL_LEVEL_BITS))
+
+// Command defines
+#define MAX_BATCH_CMDS 64
+#define CMD_SEPARATORS "\n;"
+#define CMD_MAX_ARGS 3
+
+// Statistics defines
+#define STATS_LATENCY_BUCKETS 32
+
+/* Actions understood by the text protocol */
+enum led_action {
+    LED_ACTION_ON,
+    LED_ACTION_OFF,
+    LED_ACTION_BLINK,
+    LED_ACTION_TOGGLE,
+    LED_ACTION_QUERY,
+    LED_ACTION_PWM,
+    LED_ACTION_STAGE,
+    LED_ACTION_COMMIT,
+};
+
+/*
+ * One parsed "pin:action", "mask:bits:action", "query", "stage" or
+ * "commit" command. Actions with parameters keep them in args: period,
+ * duty and count for blink, duty and frequency for pwm. at is the
+ * CLOCK_MONOTONIC time of a command prefixed with "@<ns> ", 0 for one to
+ * apply at once.
+ */
+struct led_cmd {
+    u32 mask;
+    enum led_action action;
+    unsigned int args[CMD_MAX_ARGS];
+    u64 at;
+};
+
+/* A batch of commands folded into one update of the pins */
+struct led_update {
+    u32 set;
+    u32 clear;
+    u32 toggle;
+    u32 blink;
+    u32 pwm;
+    bool query;
+    u16 pwm_duty[GPIO_NUM_PINS];
+    u16 pwm_freq[GPIO_NUM_PINS];
+    u32 blink_period[GPIO_NUM_PINS];
+    u32 blink_count[GPIO_NUM_PINS];
+    u8 blink_duty[GPIO_NUM_PINS];
+};
+
+/*
+ * Playback state of a timeline. base is the start of the current cycle,
+ * index the next keyframe, times in ns of CLOCK_MONOTONIC.
+ */
+struct led_player {
+    struct led_keyframe *frames;
+    unsigned int count;
+    unsigned int index;
+    u32 mode;
+    u32 loops;
+    u32 pins;
+    bool reverse;
+    u64 length_ns;
+    u64 base;
+};
+
+/*
+ * Blink state of one pin, times in ns of CLOCK_MONOTONIC. remaining counts
+ * the cycles left, 0 for ever.
+ */
+struct led_blink_channel {
+    u64 period_ns;
+    u64 on_ns;
+    u64 next;
+    u32 remaining;
+    bool level;
+};
+
+/*
+ * All blinking pins, stepped by a single timer. Every pin's cycles start
+ * at multiples of its period on CLOCK_MONOTONIC, so pins whose periods
+ * divide each other stay in phase and share their edges; edges within
+ * BLINK_EDGE_SLACK_NS of each other are applied together.
+ */
+struct led_blink_sched {
+    u32 active;
+    struct led_blink_channel channels[GPIO_NUM_PINS];
+};
+
+/* Software PWM state of one pin, times in ns of CLOCK_MONOTONIC */
+struct led_pwm_channel {
+    u32 on_ns;
+    u32 off_ns;
+    u64 next;
+    bool level;
+};
+
+/*
+ * All PWM channels, stepped by a single timer. Edges of different pins
+ * that fall within PWM_EDGE_SLACK_NS of each other are applied together.
+ */
+struct led_pwm_sched {
+    u32 active;
+    struct led_pwm_channel channels[GPIO_NUM_PINS];
+};
+
+/*
+ * Execution state of a pattern program. counters holds the remaining
+ * iterations of every LOOP that is in progress, time the moment the
+ * current run is due.
+ */
+struct led_vm {
+    struct led_insn *insns;
+    unsigned int count;
+    unsigned int pc;
+    u32 pins;
+    u64 time;
+    u16 counters[LED_PROGRAM_MAX_INSNS];
+};
+
+/*
+ * An event in the timing wheel: the pins to set and clear once expires
+ * (ns of CLOCK_MONOTONIC) has passed. bucket remembers the slot holding
+ * it, so it can be cancelled without a search; seq orders events with
+ * the same deadline by when they were scheduled.
+ */
+struct led_wheel_entry {
+    struct hlist_node node;
+    u64 expires;
+    u64 seq;
+    u32 set;
+    u32 clear;
+    u16 bucket;
+};
+
+/*
+ * Hierarchical timing wheel. Level n has 64 slots covering 64^n ticks
+ * each; entries are filed by how far in the future they are, and slots of
+ * the upper levels are re-sorted one level down when clk reaches them.
+ * pending has a bit per non-empty slot, so the next due tick is found
+ * without walking empty ones. Ticks before clk have been processed.
+ */
+struct led_wheel {
+    u64 clk;
+    u64 seq;
+    unsigned int count;
+    u64 pending[WHEEL_LEVELS];
+    struct hlist_head slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+/* Driver counters, kept per CPU so the hot paths never share a cache line */
+struct led_stats {
+    u64 commands_accepted;
+    u64 commands_rejected;
+    u64 mmio_writes;
+    u64 blink_cycles;
+    u64 elided_writes;
+    u64 pwm_edges;
+    u64 sched_fired;
+    u64 sched_missed;
+    u64 pin_commands[GPIO_NUM_PINS];
+    u64 pin_mmio_writes[GPIO_NUM_PINS];
+    u64 pin_elided[GPIO_NUM_PINS];
+    u64 pin_blink_cycles[GPIO_NUM_PINS];
+    // Bucket N counts latencies in [2^(N-1), 2^N) ns
+    u64 latency_hist[STATS_LATENCY_BUCKETS];
+    u64 pwm_jitter_hist[STATS_LATENCY_BUCKETS];
+    u64 sched_late_hist[STATS_LATENCY_BUCKETS];
+};
+
+DECLARE_PER_CPU(struct led_stats, led_stats);
+
+/* Sums one led_stats field over all CPUs */
+#define led_stats_read(field) ({                          \
+    u64 __sum = 0;                                        \
+    int __cpu;                                            \
+    for_each_possible_cpu(__cpu)                          \
+        __sum += per_cpu(led_stats, __cpu).field;         \
+    __sum;                                                \
+})
+
+// Register block, either ioremap'd hardware or simulated memory
+extern volatile unsigned int *gpio;
+extern bool gpio_simulated;
+
+// Pins the driver is allowed to drive, bit N is GPIO pin N
+extern u32 managed_pins;
+
+// Called with the pins whose driven level changed, from any context
+extern void (*gpio_levels_changed)(u32 pins);
+
+// Register access
+u32 gpio_read(unsigned int offset);
+void gpio_write(unsigned int offset, u32 value);
+void gpio_update_mask(u32 set, u32 clear);
+void gpio_update_mask_toggle(u32 set, u32 clear, u32 toggle);
+void gpio_set(int pin);
+void gpio_clear(int pin);
+u32 gpio_get_levels(void);
+void gpio_resync(void);
+void set_gpio_direction_out_mask(u32 mask);
+
+/* True if every pin in mask is managed by the driver */
+static inline bool gpio_pins_managed(u32 mask) {
+    return !(mask & ~READ_ONCE(managed_pins));
+}
+
+// Command parsing
+const char *parse_command(const char *input, struct led_cmd *cmd);
+ssize_t parse_input(char *input, size_t len, struct led_cmd *cmds,
+                    unsigned int *count, char *error, size_t error_size);
+void fold_commands(const struct led_cmd *cmds, unsigned int count,
+                   struct led_update *update);
+void led_update_add(struct led_update *update, const struct led_cmd *cmd);
+
+// Timeline sequencing
+const char *led_timeline_check(const struct led_timeline *timeline,
+                               const struct led_keyframe *frames);
+u32 led_timeline_pins(const struct led_keyframe *frames, unsigned int count);
+u64 led_player_start(struct led_player *player, const struct led_timeline *timeline,
+                     struct led_keyframe *frames, u64 now);
+const struct led_keyframe *led_player_step(struct led_player *player, u64 *next);
+
+// Pattern programs
+const char *led_program_check(const struct led_insn *insns, unsigned int count);
+u32 led_program_pins(const struct led_insn *insns, unsigned int count);
+u64 led_vm_start(struct led_vm *vm, struct led_insn *insns, unsigned int count, u64 now);
+u64 led_vm_run(struct led_vm *vm, u32 *set, u32 *clear);
+
+// Blink scheduler
+bool led_blink_start(struct led_blink_sched *sched, int pin, unsigned int period_ms,
+                     unsigned int duty_pct, unsigned int count, u64 now);
+void led_blink_stop_mask(struct led_blink_sched *sched, u32 mask);
+u64 led_blink_next(const struct led_blink_sched *sched);
+u64 led_blink_run(struct led_blink_sched *sched, u64 now);
+
+// Timing wheel
+void led_wheel_init(struct led_wheel *wheel, u64 now);
+void led_wheel_add(struct led_wheel *wheel, struct led_wheel_entry *entry);
+bool led_wheel_del(struct led_wheel *wheel, struct led_wheel_entry *entry);
+u64 led_wheel_next(const struct led_wheel *wheel);
+unsigned int led_wheel_advance(struct led_wheel *wheel, u64 now, struct hlist_head *expired);
+
+// Software PWM
+void led_pwm_start(struct led_pwm_sched *sched, int pin, unsigned int duty,
+                   unsigned int freq_hz, u64 now);
+void led_pwm_stop_mask(struct led_pwm_sched *sched, u32 mask);
+u64 led_pwm_next(const struct led_pwm_sched *sched);
+u64 led_pwm_run(struct led_pwm_sched *sched, u64 now);
+
+// Statistics
+void led_stats_command(u32 mask);
+void led_stats_rejected(void);
+void led_stats_elided(u32 pins, int writes);
+void led_stats_latency(u64 ns);
+void led_stats_pwm_jitter(u64 ns);
+void led_stats_sched_late(u64 ns);
+void led_stats_sched_missed(void);
+
+#endif /* LED_CORE_H */
@@ -0,0 +1,2191 @@
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/hashtable.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/llist.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/uaccess.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
+#include <linux/init.h>
+
+#include "led_control.h"
+#include "led_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "led_trace.h"
+
+// Module defines
+#define DEVICE_NAME "led-control"
+#define CLASS_NAME "led"
+#define ERROR_MSG_SIZE 256
+#define STATUS_MSG_SIZE (ERROR_MSG_SIZE + 384)
+#define WRITE_MAX_SIZE PAGE_SIZE
+#define FRAME_RATE_MAX 10000U
+#define SCHED_MAX_EVENTS 65536
+#define SCHED_HASH_BITS 12
+
+// I/O defines
+#define GPIO_PIN_21 21
+#define GPIO_PIN_20 20
+#define GPIO_PIN_16 16
+
+/*
+ * A running timeline or pattern program. Patterns own their pins
+ * exclusively, so each one lives in the slot of the lowest pin it drives.
+ */
+struct led_pattern_slot {
+    struct hrtimer timer;
+    u32 pins;
+    bool is_program;
+    union {
+        struct led_player player;
+        struct led_vm vm;
+    };
+};
+
+/* Per open file state, so that every client only sees its own results */
+struct led_client {
+    struct mutex lock;
+    atomic_t pending;
+    wait_queue_head_t applied;
+    unsigned int events_seen;
+    bool error_pending;
+    ssize_t last_result;
+    unsigned int last_applied;
+    bool has_query;
+    u32 query_managed;
+    u32 query_levels;
+    char last_error[ERROR_MSG_SIZE];
+    char status[STATUS_MSG_SIZE];
+    int status_len;
+    struct led_ring *ring;
+    struct list_head ring_node;
+    struct list_head sched_events;
+    bool staging;
+    struct led_update stage;
+    bool commit_waiting;
+    u32 commit_frame;
+};
+
+/*
+ * A pending scheduled event. It sits in sched_wheel by time, in
+ * sched_hash by client and id, and in the list of its client.
+ */
+struct led_sched_node {
+    struct led_wheel_entry entry;
+    struct hlist_node hash;
+    struct list_head client_node;
+    struct led_client *client;
+    u64 id;
+};
+
+/*
+ * One folded batch on its way to the applier. Writers push these onto
+ * led_queue without taking any lock, led_apply_work applies them in order.
+ * A commit request carries a staging buffer for the next frame in update,
+ * an update request the reserved timed events of its batch.
+ */
+struct led_request {
+    struct llist_node node;
+    struct led_client *client;
+    struct led_update update;
+    struct hlist_head events;
+    bool commit;
+    struct led_timeline timeline;
+    struct led_keyframe *frames;
+    struct led_insn *insns;
+    unsigned int insn_count;
+};
+
+// Module variables
+static int major_number;
+static struct class* led_class = NULL;
+static struct device* led_device = NULL;
+static struct led_pattern_slot pattern_slots[GPIO_NUM_PINS];
+
+// Serializes starting and stopping of patterns, blinks and PWM channels
+static DEFINE_MUTEX(blink_lock);
+
+// Blinking pins, all stepped by blink_timer
+static struct led_blink_sched blink_sched;
+static struct hrtimer blink_timer;
+static DEFINE_SPINLOCK(blink_sched_lock);
+
+// Scheduled events of all clients, fired by sched_timer. Timed commands
+// of a write hold a reserved place until the applier files them.
+static struct led_wheel sched_wheel;
+static struct hrtimer sched_timer;
+static DEFINE_SPINLOCK(sched_lock);
+static DEFINE_HASHTABLE(sched_hash, SCHED_HASH_BITS);
+static unsigned int sched_reserved;
+
+// Software PWM channels, all stepped by pwm_timer
+static struct led_pwm_sched pwm_sched;
+static struct hrtimer pwm_timer;
+static DEFINE_SPINLOCK(pwm_lock);
+
+// Bumped on every level change, poll() compares it with what a client has read
+static DECLARE_WAIT_QUEUE_HEAD(led_event_wait);
+static atomic_t led_events = ATOMIC_INIT(0);
+static struct workqueue_struct *led_wq;
+static LLIST_HEAD(led_queue);
+
+/*
+ * Clients with a mapped command ring. Changes take both locks, the
+ * applier walks the list under the mutex and the poll timer under the
+ * spinlock.
+ */
+static LIST_HEAD(ring_clients);
+static DEFINE_MUTEX(ring_mutex);
+static DEFINE_SPINLOCK(ring_lock);
+static struct hrtimer ring_timer;
+
+static unsigned int ring_poll_us = 1000;
+module_param(ring_poll_us, uint, 0444);
+MODULE_PARM_DESC(ring_poll_us, "Interval at which mapped command rings are checked, 0 to rely on LED_IOC_RING_KICK");
+
+/*
+ * Desired state page and committed staging buffers, applied by
+ * frame_timer while the page is mapped or a commit is pending. Committed
+ * buffers are merged into frame_commit until the next frame. Frames that
+ * carry commits are numbered: frames_taken is the last one whose commits
+ * have been collected, frames_out the last one written to the registers.
+ */
+static struct led_frame *led_frame;
+static struct hrtimer frame_timer;
+static DEFINE_MUTEX(frame_mutex);
+static unsigned int frame_maps;
+static u32 frame_seq;
+static DEFINE_SPINLOCK(commit_lock);
+static struct led_update frame_commit;
+static bool commit_pending;
+static u32 frames_taken;
+static u32 frames_out;
+
+static unsigned int frame_rate_hz = 100;
+module_param(frame_rate_hz, uint, 0644);
+MODULE_PARM_DESC(frame_rate_hz, "Rate at which the mapped desired state page is applied (1-10000)");
+
+module_param_named(simulate, gpio_simulated, bool, 0444);
+MODULE_PARM_DESC(simulate, "Drive a simulated GPIO register block instead of the BCM2837 hardware");
+
+static int pins[GPIO_NUM_PINS] = { GPIO_PIN_16, GPIO_PIN_20, GPIO_PIN_21 };
+static int num_pins = 3;
+module_param_array(pins, int, &num_pins, 0444);
+MODULE_PARM_DESC(pins, "GPIO pins driven by the device (default 16,20,21)");
+
+// Local functions
+static void led_pattern_init(void);
+static void led_timeline_play(const struct led_timeline *timeline, struct led_keyframe *frames);
+static void led_program_run(struct led_insn *insns, unsigned int count);
+static void led_pattern_stop_mask(u32 mask);
+static u32 led_pattern_active_mask(void);
+static void led_keyframe_apply(const struct led_keyframe *frame);
+static enum hrtimer_restart led_pattern_timer_fn(struct hrtimer *timer);
+static void led_blink_init(void);
+static void led_blink_apply(const struct led_update *update);
+static void led_blink_stop(u32 mask);
+static enum hrtimer_restart led_blink_timer_fn(struct hrtimer *timer);
+static void led_sched_init(void);
+static struct led_sched_node *led_sched_find(struct led_client *client, u64 id);
+static struct led_sched_node *led_sched_alloc(struct led_client *client, u64 expires,
+                                              u32 set, u32 clear);
+static void led_sched_insert(struct led_sched_node *node);
+static int led_sched_add(struct led_client *client, u64 expires, u32 set, u32 clear,
+                         const u64 *id);
+static int led_sched_reserve(struct led_client *client, const struct led_cmd *cmds,
+                             unsigned int count, u64 now, struct hlist_head *events);
+static void led_sched_file(struct hlist_head *events);
+static void led_sched_unreserve(struct hlist_head *events);
+static int led_sched_cancel(struct led_client *client, u64 id);
+static void led_sched_cancel_all(struct led_client *client);
+static void led_sched_free(struct led_sched_node *node);
+static enum hrtimer_restart led_sched_timer_fn(struct hrtimer *timer);
+static void led_pwm_init(void);
+static void led_pwm_apply(const struct led_update *update);
+static void led_pwm_apply_mask(u32 mask, unsigned int duty, unsigned int freq_hz);
+static void led_pwm_stop(u32 mask);
+static enum hrtimer_restart led_pwm_timer_fn(struct hrtimer *timer);
+static void apply_update(struct led_update *update);
+static int led_queue_update(struct led_client *client, const struct led_update *update);
+static int led_queue_commit(struct led_client *client);
+static int led_queue_timed(struct led_client *client, const struct led_update *update,
+                           struct hlist_head *events);
+static int led_queue_timeline(struct led_client *client, const struct led_timeline *timeline,
+                              struct led_keyframe *frames);
+static int led_queue_program(struct led_client *client, struct led_insn *insns,
+                             unsigned int count);
+static void led_queue_push(struct led_client *client, struct led_request *req);
+static void led_apply_work_fn(struct work_struct *work);
+static int led_client_wait_applied(struct led_client *client);
+static void led_notify_levels(u32 pins);
+static void led_ring_drain(struct led_client *client);
+static void led_ring_drain_all(void);
+static bool led_ring_pending(void);
+static enum hrtimer_restart led_ring_timer_fn(struct hrtimer *timer);
+static int led_ring_mmap(struct led_client *client, struct vm_area_struct *vma);
+static int led_frame_mmap(struct vm_area_struct *vma);
+static void led_frame_vm_open(struct vm_area_struct *vma);
+static void led_frame_vm_close(struct vm_area_struct *vma);
+static ktime_t led_frame_period(void);
+static enum hrtimer_restart led_frame_timer_fn(struct hrtimer *timer);
+static void led_frame_commit(struct led_client *client, const struct led_update *stage);
+static void led_update_merge(struct led_update *update, const struct led_update *levels);
+static bool led_action_stageable(enum led_action action);
+static bool led_client_frame_out(struct led_client *client);
+static ssize_t handle_input(struct led_client *client, char *input, size_t len);
+static int led_client_format_status(struct led_client *client);
+static int led_ctrl_dev_open(struct inode *, struct file *);
+static int led_ctrl_dev_release(struct inode *, struct file *);
+static int led_ctrl_dev_mmap(struct file *, struct vm_area_struct *);
+static __poll_t led_ctrl_dev_poll(struct file *, poll_table *);
+static ssize_t led_ctrl_dev_read(struct file *, char *, size_t, loff_t *);
+static ssize_t led_ctrl_dev_write(struct file *, const char *, size_t, loff_t *);
+static long led_ctrl_dev_ioctl(struct file *, unsigned int, unsigned long);
+static long led_ctrl_do_ioctl(struct led_client *client, unsigned int cmd, void __user *argp);
+static ssize_t managed_pins_show(struct device *, struct device_attribute *, char *);
+static ssize_t managed_pins_store(struct device *, struct device_attribute *, const char *, size_t);
+static ssize_t commands_accepted_show(struct device *, struct device_attribute *, char *);
+static ssize_t commands_rejected_show(struct device *, struct device_attribute *, char *);
+static ssize_t mmio_writes_show(struct device *, struct device_attribute *, char *);
+static ssize_t blink_cycles_show(struct device *, struct device_attribute *, char *);
+static ssize_t elided_writes_show(struct device *, struct device_attribute *, char *);
+static ssize_t pwm_edges_show(struct device *, struct device_attribute *, char *);
+static ssize_t sched_fired_show(struct device *, struct device_attribute *, char *);
+static ssize_t sched_missed_show(struct device *, struct device_attribute *, char *);
+static ssize_t pins_show(struct device *, struct device_attribute *, char *);
+static ssize_t latency_hist_show(struct device *, struct device_attribute *, char *);
+static ssize_t pwm_jitter_hist_show(struct device *, struct device_attribute *, char *);
+static ssize_t sched_late_hist_show(struct device *, struct device_attribute *, char *);
+
+/* All register updates from clients are applied by this one work item */
+static DECLARE_WORK(led_apply_work, led_apply_work_fn);
+
+/* Keeps the frame timer running while the desired state page is mapped */
+static const struct vm_operations_struct led_frame_vm_ops = {
+    .open = led_frame_vm_open,
+    .close = led_frame_vm_close,
+};
+
+/* File operations structure */
+static struct file_operations f_ops = {
+    .owner = THIS_MODULE,
+    .open = led_ctrl_dev_open,
+    .read = led_ctrl_dev_read,
+    .write = led_ctrl_dev_write,
+    .mmap = led_ctrl_dev_mmap,
+    .poll = led_ctrl_dev_poll,
+    .unlocked_ioctl = led_ctrl_dev_ioctl,
+    .compat_ioctl = compat_ptr_ioctl,
+    .release = led_ctrl_dev_release,
+};
+
+/* Device attributes */
+static DEVICE_ATTR_RW(managed_pins);
+
+static struct attribute *led_attrs[] = {
+    &dev_attr_managed_pins.attr,
+    NULL,
+};
+
+static const struct attribute_group led_attr_group = {
+    .attrs = led_attrs,
+};
+
+/* Statistics, exposed in the stats directory of the led device */
+static DEVICE_ATTR_RO(commands_accepted);
+static DEVICE_ATTR_RO(commands_rejected);
+static DEVICE_ATTR_RO(mmio_writes);
+static DEVICE_ATTR_RO(blink_cycles);
+static DEVICE_ATTR_RO(elided_writes);
+static DEVICE_ATTR_RO(pwm_edges);
+static DEVICE_ATTR_RO(sched_fired);
+static DEVICE_ATTR_RO(sched_missed);
+static DEVICE_ATTR_RO(pins);
+static DEVICE_ATTR_RO(latency_hist);
+static DEVICE_ATTR_RO(pwm_jitter_hist);
+static DEVICE_ATTR_RO(sched_late_hist);
+
+static struct attribute *led_stats_attrs[] = {
+    &dev_attr_commands_accepted.attr,
+    &dev_attr_commands_rejected.attr,
+    &dev_attr_mmio_writes.attr,
+    &dev_attr_blink_cycles.attr,
+    &dev_attr_elided_writes.attr,
+    &dev_attr_pwm_edges.attr,
+    &dev_attr_sched_fired.attr,
+    &dev_attr_sched_missed.attr,
+    &dev_attr_pins.attr,
+    &dev_attr_latency_hist.attr,
+    &dev_attr_pwm_jitter_hist.attr,
+    &dev_attr_sched_late_hist.attr,
+    NULL,
+};
+
+static const struct attribute_group led_stats_group = {
+    .name = "stats",
+    .attrs = led_stats_attrs,
+};
+
+static const struct attribute_group *led_groups[] = {
+    &led_attr_group,
+    &led_stats_group,
+    NULL,
+};
+
+static int __init led_pins_init(void) {
+    u32 mask = 0;
+    int i;
+
+    for (i = 0; i < num_pins; i++) {
+        if (pins[i] < 0 || pins[i] >= GPIO_NUM_PINS) {
+            printk(KERN_ERR "%s: Invalid pin %d\n", __func__, pins[i]);
+            return -EINVAL;
+        }
+        mask |= BIT(pins[i]);
+    }
+
+    managed_pins = mask;
+    return 0;
+}
+
+static int __init led_frame_init(void) {
+    led_frame = vmalloc_user(sizeof(*led_frame));
+    if (!led_frame) {
+        return -ENOMEM;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&frame_timer, led_frame_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&frame_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    frame_timer.function = led_frame_timer_fn;
+#endif
+    return 0;
+}
+
+static int __init gpio_init(void) {
+    if (gpio_simulated) {
+        gpio = kzalloc(GPIO_MAPPED_REGION_SIZE, GFP_KERNEL);
+        if (!gpio) {
+            printk(KERN_ERR "Failed to allocate simulated GPIO registers\n");
+            return -ENOMEM;
+        }
+        printk(KERN_INFO "%s: Using simulated GPIO registers\n", __func__);
+        return 0;
+    }
+
+    gpio = (volatile unsigned int *) ioremap(
+        GPIO_BASE, GPIO_MAPPED_REGION_SIZE);
+
+    if (!gpio) {
+        printk(KERN_ERR "Failed to map GPIO memory\n");
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void gpio_exit(void) {
+    if (gpio_simulated) {
+        kfree((void *)gpio);
+    } else {
+        iounmap(gpio);
+    }
+}
+
+static int __init led_ctrl_init(void) {
+    int ret;
+
+    printk(KERN_INFO "%s: Initializing the LED Control Device\n", __func__);
+
+    ret = led_pins_init();
+    if (ret) {
+        return ret;
+    }
+
+    ret = led_frame_init();
+    if (ret) {
+        return ret;
+    }
+
+    // Registers must be usable before the device node shows up
+    ret = gpio_init();
+    if (ret) {
+        vfree(led_frame);
+        return ret;
+    }
+
+    gpio_levels_changed = led_notify_levels;
+    gpio_resync();
+    led_pattern_init();
+    led_blink_init();
+    led_sched_init();
+    led_pwm_init();
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&ring_timer, led_ring_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+    hrtimer_init(&ring_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    ring_timer.function = led_ring_timer_fn;
+#endif
+
+    // Set LEDs to be output pins
+    set_gpio_direction_out_mask(managed_pins);
+
+    // Ordered, so queued batches are applied one at a time
+    led_wq = alloc_ordered_workqueue("led-control", WQ_HIGHPRI);
+    if (!led_wq) {
+        gpio_exit();
+        vfree(led_frame);
+        return -ENOMEM;
+    }
+
+    major_number = register_chrdev(0, DEVICE_NAME, &f_ops);
+    if (major_number < 0) {
+        destroy_workqueue(led_wq);
+        gpio_exit();
+        vfree(led_frame);
+        printk(KERN_ALERT "%s: failed to register a major number\n", __func__);
+        return major_number;
+    }
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
+    led_class = class_create(CLASS_NAME);
+#else
+    led_class = class_create(THIS_MODULE, CLASS_NAME);
+#endif
+
+    if (IS_ERR(led_class)) {
+        unregister_chrdev(major_number, DEVICE_NAME);
+        destroy_workqueue(led_wq);
+        gpio_exit();
+        vfree(led_frame);
+        printk(KERN_ALERT "%s: Failed to register device class\n", __func__);
+        return PTR_ERR(led_class);
+    }
+
+    led_device = device_create_with_groups(led_class, NULL, MKDEV(major_number, 0), NULL,
+                                           led_groups, DEVICE_NAME);
+    if (IS_ERR(led_device)) {
+        class_destroy(led_class);
+        unregister_chrdev(major_number, DEVICE_NAME);
+        destroy_workqueue(led_wq);
+        gpio_exit();
+        vfree(led_frame);
+        printk(KERN_ALERT "%s: Failed to create the device\n", __func__);
+        return PTR_ERR(led_device);
+    }
+
+    printk(KERN_INFO "%s: Device created successfully\n", __func__);
+
+    return 0;
+}
+
+static void __exit led_ctrl_exit(void) {
+    // Removing the device drains managed_pins_store(), which drives the
+    // pins and starts timers
+    device_destroy(led_class, MKDEV(major_number, 0));
+
+    // Every client is gone, this only waits for the last batches
+    hrtimer_cancel(&ring_timer);
+    destroy_workqueue(led_wq);
+
+    // Stop patterns, blink, PWM and frame timers before touching the pins
+    mutex_lock(&blink_lock);
+    led_pattern_stop_mask(U32_MAX);
+    mutex_unlock(&blink_lock);
+    led_blink_stop(U32_MAX);
+    hrtimer_cancel(&blink_timer);
+    hrtimer_cancel(&sched_timer);
+    led_pwm_stop(U32_MAX);
+    hrtimer_cancel(&pwm_timer);
+    hrtimer_cancel(&frame_timer);
+
+    // Turn LEDs off
+    gpio_update_mask(0, managed_pins);
+
+    gpio_exit();
+    vfree(led_frame);
+
+    class_unregister(led_class);
+    class_destroy(led_class);
+    unregister_chrdev(major_number, DEVICE_NAME);
+
+    printk(KERN_INFO "%s: Goodbye from the LED Control Device!\n", __func__);
+}
+
+static void led_pattern_init(void) {
+    int pin;
+
+    for (pin = 0; pin < GPIO_NUM_PINS; pin++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+        hrtimer_setup(&pattern_slots[pin].timer, led_pattern_timer_fn,
+                      CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+        hrtimer_init(&pattern_slots[pin].timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+        pattern_slots[pin].timer.function = led_pattern_timer_fn;
+#endif
+    }
+}
+
+/*
+ * Starts a checked timeline, taking over frames. Whatever runs on its pins
+ * is stopped first. Called with blink_lock held.
+ */
+static void led_timeline_play(const struct led_timeline *timeline, struct led_keyframe *frames) {
+    u32 pins = led_timeline_pins(frames, timeline->count);
+    struct led_pattern_slot *ps = &pattern_slots[__ffs(pins)];
+    u64 first;
+
+    led_pattern_stop_mask(pins);
+    led_blink_stop(pins);
+    led_pwm_stop(pins);
+
+    ps->pins = pins;
+    ps->is_program = false;
+    first = led_player_start(&ps->player, timeline, frames, ktime_get_ns());
+    hrtimer_start(&ps->timer, ns_to_ktime(first), HRTIMER_MODE_ABS);
+}
+
+/* Same as led_timeline_play() for a checked pattern program */
+static void led_program_run(struct led_insn *insns, unsigned int count) {
+    u32 pins = led_program_pins(insns, count);
+    struct led_pattern_slot *ps = &pattern_slots[__ffs(pins)];
+    u64 first;
+
+    led_pattern_stop_mask(pins);
+    led_blink_stop(pins);
+    led_pwm_stop(pins);
+
+    ps->pins = pins;
+    ps->is_program = true;
+    first = led_vm_start(&ps->vm, insns, count, ktime_get_ns());
+    hrtimer_start(&ps->timer, ns_to_ktime(first), HRTIMER_MODE_ABS);
+}
+
+/*
+ * Stops every pattern driving a pin in mask, including the pins it has
+ * outside mask, and frees finished ones. The PWM channels a timeline
+ * started on its dimmed pins stop with it, leaving those pins off; the
+ * other pins keep their last level. Called with blink_lock held.
+ */
+static void led_pattern_stop_mask(u32 mask) {
+    struct led_pattern_slot *ps;
+    unsigned long flags;
+    u32 stopped = 0;
+    u32 dimmed;
+    bool cancelled;
+    int slot;
+
+    for (slot = 0; slot < GPIO_NUM_PINS; slot++) {
+        ps = &pattern_slots[slot];
+        if (!(ps->pins & mask)) {
+            continue;
+        }
+
+        cancelled = hrtimer_cancel(&ps->timer);
+        if (ps->is_program) {
+            if (cancelled) {
+                trace_led_program_stop(ps->pins, false);
+            }
+            kfree(ps->vm.insns);
+        } else {
+            if (cancelled) {
+                trace_led_timeline_stop(ps->pins, false);
+            }
+            kfree(ps->player.frames);
+        }
+        stopped |= ps->pins;
+        ps->pins = 0;
+    }
+
+    if (!stopped) {
+        return;
+    }
+    spin_lock_irqsave(&pwm_lock, flags);
+    dimmed = pwm_sched.active & stopped;
+    led_pwm_stop_mask(&pwm_sched, stopped);
+    spin_unlock_irqrestore(&pwm_lock, flags);
+    gpio_update_mask(0, dimmed);
+}
+
+static u32 led_pattern_active_mask(void) {
+    u32 mask = 0;
+    int slot;
+
+    for (slot = 0; slot < GPIO_NUM_PINS; slot++) {
+        if (hrtimer_active(&pattern_slots[slot].timer)) {
+            mask |= pattern_slots[slot].pins;
+        }
+    }
+    return mask;
+}
+
+/* Applies one keyframe as a single GPCLR0/GPSET0 update */
+static void led_keyframe_apply(const struct led_keyframe *frame) {
+    u32 dim = 0;
+
+    if (frame->duty && frame->duty < PWM_DUTY_MAX) {
+        dim = frame->levels;
+    }
+
+    led_pwm_stop(frame->mask & ~dim);
+    gpio_update_mask(frame->levels & ~dim, frame->mask & ~frame->levels);
+    if (dim) {
+        led_pwm_apply_mask(dim, frame->duty, frame->freq_hz);
+    }
+}
+
+static enum hrtimer_restart led_pattern_timer_fn(struct hrtimer *timer) {
+    struct led_pattern_slot *ps = container_of(timer, struct led_pattern_slot, timer);
+    u32 set, clear;
+    u64 next;
+
+    if (ps->is_program) {
+        next = led_vm_run(&ps->vm, &set, &clear);
+        gpio_update_mask(set, clear);
+    } else {
+        led_keyframe_apply(led_player_step(&ps->player, &next));
+    }
+
+    // Completion is an event even when the last step changed no level
+    if (!next) {
+        atomic_inc(&led_events);
+        wake_up_interruptible_all(&led_event_wait);
+        return HRTIMER_NORESTART;
+    }
+
+    hrtimer_set_expires(timer, ns_to_ktime(next));
+    return HRTIMER_RESTART;
+}
+
+static void led_blink_init(void) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&blink_timer, led_blink_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+    hrtimer_init(&blink_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    blink_timer.function = led_blink_timer_fn;
+#endif
+}
+
+/*
+ * (Re)starts the blinking pins of update on the shared tick. Their first
+ * levels are written together, and the timer is reprogrammed for the
+ * earliest edge of all blinking pins.
+ */
+static void led_blink_apply(const struct led_update *update) {
+    unsigned long bits = update->blink;
+    u64 now = ktime_get_ns();
+    u32 set = 0, clear = 0;
+    unsigned long flags;
+    int pin;
+
+    spin_lock_irqsave(&blink_sched_lock, flags);
+    for_each_set_bit(pin, &bits, GPIO_NUM_PINS) {
+        if (led_blink_start(&blink_sched, pin, update->blink_period[pin],
+                            update->blink_duty[pin], update->blink_count[pin], now)) {
+            set |= BIT(pin);
+        } else {
+            clear |= BIT(pin);
+        }
+    }
+    gpio_update_mask(set, clear);
+    hrtimer_start(&blink_timer, ns_to_ktime(led_blink_next(&blink_sched)), HRTIMER_MODE_ABS);
+    spin_unlock_irqrestore(&blink_sched_lock, flags);
+}
+
+/* The timer stops by itself once no pin blinks */
+static void led_blink_stop(u32 mask) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&blink_sched_lock, flags);
+    led_blink_stop_mask(&blink_sched, mask);
+    spin_unlock_irqrestore(&blink_sched_lock, flags);
+}
+
+static enum hrtimer_restart led_blink_timer_fn(struct hrtimer *timer) {
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    u64 next;
+
+    spin_lock(&blink_sched_lock);
+    next = led_blink_run(&blink_sched, ktime_get_ns());
+
+    // led_blink_apply() may have requeued the timer meanwhile, keep its expiry
+    if (next && !hrtimer_is_queued(timer)) {
+        hrtimer_set_expires(timer, ns_to_ktime(next));
+        ret = HRTIMER_RESTART;
+    }
+    spin_unlock(&blink_sched_lock);
+
+    return ret;
+}
+
+static void led_sched_init(void) {
+    led_wheel_init(&sched_wheel, ktime_get_ns());
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&sched_timer, led_sched_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+    hrtimer_init(&sched_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    sched_timer.function = led_sched_timer_fn;
+#endif
+}
+
+/* Looks up a pending event of client. Called with sched_lock held. */
+static struct led_sched_node *led_sched_find(struct led_client *client, u64 id) {
+    struct led_sched_node *node;
+
+    hash_for_each_possible(sched_hash, node, hash, id) {
+        if (node->client == client && node->id == id) {
+            return node;
+        }
+    }
+    return NULL;
+}
+
+static struct led_sched_node *led_sched_alloc(struct led_client *client, u64 expires,
+                                              u32 set, u32 clear) {
+    struct led_sched_node *node;
+
+    node = kzalloc(sizeof(*node), GFP_KERNEL);
+    if (!node) {
+        return NULL;
+    }
+    node->client = client;
+    node->entry.expires = expires;
+    node->entry.set = set;
+    node->entry.clear = clear;
+    return node;
+}
+
+/*
+ * Files node in the wheel and the event list of its client. The timer is
+ * only moved when the event is due before its current expiry, so filling
+ * the wheel with many events costs one hrtimer update at most per earlier
+ * deadline. Called with sched_lock held.
+ */
+static void led_sched_insert(struct led_sched_node *node) {
+    u64 next;
+
+    led_wheel_add(&sched_wheel, &node->entry);
+    list_add_tail(&node->client_node, &node->client->sched_events);
+
+    next = led_wheel_next(&sched_wheel);
+    if (!hrtimer_is_queued(&sched_timer) ||
+        next < ktime_to_ns(hrtimer_get_expires(&sched_timer))) {
+        hrtimer_start(&sched_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+    }
+}
+
+/*
+ * Files a checked event due at expires, which should still be ahead. An
+ * event with an id also goes into the hash so it can be cancelled.
+ */
+static int led_sched_add(struct led_client *client, u64 expires, u32 set, u32 clear,
+                         const u64 *id) {
+    struct led_sched_node *node;
+    unsigned long flags;
+    int ret = 0;
+
+    node = led_sched_alloc(client, expires, set, clear);
+    if (!node) {
+        return -ENOMEM;
+    }
+
+    spin_lock_irqsave(&sched_lock, flags);
+    if (sched_wheel.count + sched_reserved >= SCHED_MAX_EVENTS) {
+        ret = -ENOSPC;
+    } else if (id && led_sched_find(client, *id)) {
+        ret = -EEXIST;
+    } else {
+        if (id) {
+            node->id = *id;
+            hash_add(sched_hash, &node->hash, node->id);
+        }
+        led_sched_insert(node);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    if (ret) {
+        kfree(node);
+    }
+    return ret;
+}
+
+/*
+ * Prepares events for the timed commands of a batch that are due after
+ * now and reserves their place in the wheel, all of them or none: when an
+ * allocation fails or the wheel has no room for every one, nothing is
+ * reserved and the batch can fail as a whole. The events are chained on
+ * their wheel node until led_sched_file() takes them.
+ */
+static int led_sched_reserve(struct led_client *client, const struct led_cmd *cmds,
+                             unsigned int count, u64 now, struct hlist_head *events) {
+    struct led_sched_node *node;
+    struct hlist_node *tmp;
+    unsigned int reserved = 0;
+    unsigned long flags;
+    unsigned int i;
+    u32 set, clear;
+    int ret = 0;
+
+    INIT_HLIST_HEAD(events);
+    for (i = 0; i < count; i++) {
+        if (cmds[i].at <= now) {
+            continue;
+        }
+        set = cmds[i].action == LED_ACTION_ON ? cmds[i].mask : 0;
+        clear = cmds[i].action == LED_ACTION_ON ? 0 : cmds[i].mask;
+        node = led_sched_alloc(client, cmds[i].at, set, clear);
+        if (!node) {
+            ret = -ENOMEM;
+            goto out;
+        }
+        hlist_add_head(&node->entry.node, events);
+        reserved++;
+    }
+    if (!reserved) {
+        return 0;
+    }
+
+    spin_lock_irqsave(&sched_lock, flags);
+    if (sched_wheel.count + sched_reserved + reserved > SCHED_MAX_EVENTS) {
+        ret = -ENOSPC;
+    } else {
+        sched_reserved += reserved;
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+out:
+    if (ret) {
+        hlist_for_each_entry_safe(node, tmp, events, entry.node) {
+            kfree(node);
+        }
+        INIT_HLIST_HEAD(events);
+    }
+    return ret;
+}
+
+/*
+ * Files reserved events in the wheel. Called by the applier once the
+ * commands queued before them have been applied, so a deadline that is
+ * already near cannot overtake them.
+ */
+static void led_sched_file(struct hlist_head *events) {
+    struct led_sched_node *node;
+    struct hlist_node *tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sched_lock, flags);
+    hlist_for_each_entry_safe(node, tmp, events, entry.node) {
+        hlist_del_init(&node->entry.node);
+        sched_reserved--;
+        led_sched_insert(node);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/* Frees reserved events that will never be filed and returns their place */
+static void led_sched_unreserve(struct hlist_head *events) {
+    struct led_sched_node *node;
+    struct hlist_node *tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sched_lock, flags);
+    hlist_for_each_entry_safe(node, tmp, events, entry.node) {
+        sched_reserved--;
+        kfree(node);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+    INIT_HLIST_HEAD(events);
+}
+
+static int led_sched_cancel(struct led_client *client, u64 id) {
+    struct led_sched_node *node;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sched_lock, flags);
+    node = led_sched_find(client, id);
+    if (node) {
+        led_wheel_del(&sched_wheel, &node->entry);
+        led_sched_free(node);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+
+    return node ? 0 : -ENOENT;
+}
+
+static void led_sched_cancel_all(struct led_client *client) {
+    struct led_sched_node *node, *tmp;
+    unsigned long flags;
+
+    spin_lock_irqsave(&sched_lock, flags);
+    list_for_each_entry_safe(node, tmp, &client->sched_events, client_node) {
+        led_wheel_del(&sched_wheel, &node->entry);
+        led_sched_free(node);
+    }
+    spin_unlock_irqrestore(&sched_lock, flags);
+}
+
+/* Unlinks an event that has left the wheel. Called with sched_lock held. */
+static void led_sched_free(struct led_sched_node *node) {
+    hash_del(&node->hash);
+    list_del(&node->client_node);
+    kfree(node);
+}
+
+/*
+ * Fires every event due by now. Their changes are folded in wheel order,
+ * a later event overriding an earlier one on the same pin, and written as
+ * one GPCLR0/GPSET0 update. Blinks and PWM channels on those pins are
+ * stopped first, pins of a running pattern are left to the pattern. Each
+ * event's lateness is recorded against its own deadline once the
+ * registers are written.
+ */
+static enum hrtimer_restart led_sched_timer_fn(struct hrtimer *timer) {
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    struct hlist_head expired = HLIST_HEAD_INIT;
+    struct led_sched_node *node;
+    struct hlist_node *tmp;
+    u32 set = 0, clear = 0, pins;
+    u64 now = ktime_get_ns();
+    u64 next;
+
+    spin_lock(&sched_lock);
+    led_wheel_advance(&sched_wheel, now, &expired);
+    hlist_for_each_entry(node, &expired, entry.node) {
+        set = (set & ~node->entry.clear) | node->entry.set;
+        clear = (clear & ~node->entry.set) | node->entry.clear;
+
+        // Out of reach of cancels, freed once its lateness is recorded
+        hash_del(&node->hash);
+        list_del(&node->client_node);
+    }
+
+    // led_sched_add() may have requeued the timer meanwhile, keep its expiry
+    next = led_wheel_next(&sched_wheel);
+    if (next && !hrtimer_is_queued(timer)) {
+        hrtimer_set_expires(timer, ns_to_ktime(next));
+        ret = HRTIMER_RESTART;
+    }
+    spin_unlock(&sched_lock);
+
+    if (hlist_empty(&expired)) {
+        return ret;
+    }
+
+    pins = (set | clear) & READ_ONCE(managed_pins) & ~led_pattern_active_mask();
+    spin_lock(&blink_sched_lock);
+    led_blink_stop_mask(&blink_sched, pins);
+    spin_unlock(&blink_sched_lock);
+    spin_lock(&pwm_lock);
+    led_pwm_stop_mask(&pwm_sched, pins);
+    spin_unlock(&pwm_lock);
+    gpio_update_mask(set & pins, clear & pins);
+
+    now = ktime_get_ns();
+    hlist_for_each_entry_safe(node, tmp, &expired, entry.node) {
+        led_stats_sched_late(now - node->entry.expires);
+        kfree(node);
+    }
+
+    return ret;
+}
+
+static void led_pwm_init(void) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+    hrtimer_setup(&pwm_timer, led_pwm_timer_fn, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+#else
+    hrtimer_init(&pwm_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pwm_timer.function = led_pwm_timer_fn;
+#endif
+}
+
+/* (Re)starts the PWM channels of update and reprograms the shared timer */
+static void led_pwm_apply(const struct led_update *update) {
+    unsigned long bits = update->pwm;
+    u64 now = ktime_get_ns();
+    unsigned long flags;
+    int pin;
+
+    spin_lock_irqsave(&pwm_lock, flags);
+    for_each_set_bit(pin, &bits, GPIO_NUM_PINS) {
+        led_pwm_start(&pwm_sched, pin, update->pwm_duty[pin], update->pwm_freq[pin], now);
+    }
+    hrtimer_start(&pwm_timer, ns_to_ktime(led_pwm_next(&pwm_sched)), HRTIMER_MODE_ABS);
+    spin_unlock_irqrestore(&pwm_lock, flags);
+}
+
+/* Starts the pins in mask with the same duty and frequency */
+static void led_pwm_apply_mask(u32 mask, unsigned int duty, unsigned int freq_hz) {
+    unsigned long bits = mask;
+    u64 now = ktime_get_ns();
+    unsigned long flags;
+    int pin;
+
+    spin_lock_irqsave(&pwm_lock, flags);
+    for_each_set_bit(pin, &bits, GPIO_NUM_PINS) {
+        led_pwm_start(&pwm_sched, pin, duty, freq_hz, now);
+    }
+    hrtimer_start(&pwm_timer, ns_to_ktime(led_pwm_next(&pwm_sched)), HRTIMER_MODE_ABS);
+    spin_unlock_irqrestore(&pwm_lock, flags);
+}
+
+/* The timer stops by itself once no channel is left */
+static void led_pwm_stop(u32 mask) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&pwm_lock, flags);
+    led_pwm_stop_mask(&pwm_sched, mask);
+    spin_unlock_irqrestore(&pwm_lock, flags);
+}
+
+static enum hrtimer_restart led_pwm_timer_fn(struct hrtimer *timer) {
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    u64 now = ktime_get_ns();
+    s64 late = now - ktime_to_ns(hrtimer_get_expires(timer));
+    u64 next;
+
+    led_stats_pwm_jitter(late > 0 ? late : 0);
+
+    spin_lock(&pwm_lock);
+    next = led_pwm_run(&pwm_sched, now);
+
+    // led_pwm_apply() may have requeued the timer meanwhile, keep its expiry
+    if (next && !hrtimer_is_queued(timer)) {
+        hrtimer_set_expires(timer, ns_to_ktime(next));
+        ret = HRTIMER_RESTART;
+    }
+    spin_unlock(&pwm_lock);
+
+    return ret;
+}
+
+static void apply_update(struct led_update *update) {
+    u32 managed;
+
+    mutex_lock(&blink_lock);
+
+    // Pins released since the request was checked are left alone
+    managed = READ_ONCE(managed_pins);
+    update->set &= managed;
+    update->clear &= managed;
+    update->toggle &= managed;
+    update->blink &= managed;
+    update->pwm &= managed;
+
+    // Any command replaces a running pattern, blink or PWM channel
+    led_pattern_stop_mask(update->set | update->clear | update->toggle | update->blink |
+                          update->pwm);
+    led_blink_stop(update->set | update->clear | update->toggle | update->pwm);
+    led_pwm_stop(update->set | update->clear | update->toggle | update->blink);
+    gpio_update_mask_toggle(update->set, update->clear, update->toggle);
+
+    if (update->blink) {
+        led_blink_apply(update);
+    }
+    if (update->pwm) {
+        led_pwm_apply(update);
+    }
+    mutex_unlock(&blink_lock);
+}
+
+/*
+ * Hands a folded batch to the applier. llist_add() is lock-free, so
+ * writers never wait for each other or for the registers.
+ */
+static int led_queue_update(struct led_client *client, const struct led_update *update) {
+    struct led_request *req;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->update = *update;
+
+    led_queue_push(client, req);
+    return 0;
+}
+
+/* Queues the staging buffer of client for the next frame and empties it */
+static int led_queue_commit(struct led_client *client) {
+    struct led_request *req;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->update = client->stage;
+    req->commit = true;
+    memset(&client->stage, 0, sizeof(client->stage));
+
+    led_queue_push(client, req);
+    return 0;
+}
+
+/* Queues update and files events, once it has been applied */
+static int led_queue_timed(struct led_client *client, const struct led_update *update,
+                           struct hlist_head *events) {
+    struct led_request *req;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->update = *update;
+    hlist_move_list(events, &req->events);
+
+    led_queue_push(client, req);
+    return 0;
+}
+
+/* Queues a checked timeline, the applier takes over frames */
+static int led_queue_timeline(struct led_client *client, const struct led_timeline *timeline,
+                              struct led_keyframe *frames) {
+    struct led_request *req;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->timeline = *timeline;
+    req->frames = frames;
+
+    led_queue_push(client, req);
+    return 0;
+}
+
+/* Queues a checked program, the applier takes over insns */
+static int led_queue_program(struct led_client *client, struct led_insn *insns,
+                             unsigned int count) {
+    struct led_request *req;
+
+    req = kzalloc(sizeof(*req), GFP_KERNEL);
+    if (!req) {
+        return -ENOMEM;
+    }
+    req->insns = insns;
+    req->insn_count = count;
+
+    led_queue_push(client, req);
+    return 0;
+}
+
+static void led_queue_push(struct led_client *client, struct led_request *req) {
+    req->client = client;
+    atomic_inc(&client->pending);
+    llist_add(&req->node, &led_queue);
+    queue_work(led_wq, &led_apply_work);
+}
+
+static void led_apply_work_fn(struct work_struct *work) {
+    struct led_request *req, *next;
+    struct led_client *client;
+    struct llist_node *list;
+    u32 pins;
+
+    // llist_del_all() returns the newest entry first
+    list = llist_reverse_order(llist_del_all(&led_queue));
+
+    llist_for_each_entry_safe(req, next, list, node) {
+        client = req->client;
+        if (req->frames) {
+            // Pins released since the upload was checked drop the timeline
+            mutex_lock(&blink_lock);
+            if (gpio_pins_managed(led_timeline_pins(req->frames, req->timeline.count))) {
+                led_timeline_play(&req->timeline, req->frames);
+            } else {
+                led_stats_rejected();
+                kfree(req->frames);
+            }
+            mutex_unlock(&blink_lock);
+        } else if (req->insns) {
+            mutex_lock(&blink_lock);
+            if (gpio_pins_managed(led_program_pins(req->insns, req->insn_count))) {
+                led_program_run(req->insns, req->insn_count);
+            } else {
+                led_stats_rejected();
+                kfree(req->insns);
+            }
+            mutex_unlock(&blink_lock);
+        } else if (req->commit) {
+            // Committed levels replace whatever runs on their pins now,
+            // the levels themselves go out with the next frame
+            pins = req->update.set | req->update.clear | req->update.toggle;
+            mutex_lock(&blink_lock);
+            led_pattern_stop_mask(pins);
+            led_blink_stop(pins);
+            led_pwm_stop(pins);
+            mutex_unlock(&blink_lock);
+
+            mutex_lock(&client->lock);
+            led_frame_commit(client, &req->update);
+            mutex_unlock(&client->lock);
+        } else {
+            apply_update(&req->update);
+            if (!hlist_empty(&req->events)) {
+                led_sched_file(&req->events);
+            }
+        }
+
+        // A query reports the state right after the batch has been applied
+        mutex_lock(&client->lock);
+        client->has_query = req->update.query;
+        if (req->update.query) {
+            client->query_managed = READ_ONCE(managed_pins);
+            client->query_levels = gpio_get_levels() & client->query_managed;
+        }
+        mutex_unlock(&client->lock);
+
+        if (atomic_dec_and_test(&client->pending)) {
+            wake_up_all(&client->applied);
+        }
+        kfree(req);
+    }
+
+    led_ring_drain_all();
+}
+
+/*
+ * Applies everything the producer has added to the client's ring since the
+ * last drain, folded into a single update.
+ */
+static void led_ring_drain(struct led_client *client) {
+    struct led_ring *ring = client->ring;
+    struct led_update update = { 0 };
+    struct led_cmd fold = { 0 };
+    u32 head, tail, set, clear, toggle;
+    struct led_mask *cmd;
+
+    // Pairs with the producer's release store after filling the entries
+    head = smp_load_acquire(&ring->head);
+    tail = READ_ONCE(ring->tail);
+    if (head == tail) {
+        return;
+    }
+
+    // A head further ahead than the ring is large is a producer bug
+    if (head - tail > LED_RING_ENTRIES) {
+        WRITE_ONCE(ring->rejected, ring->rejected + (head - tail));
+        led_stats_rejected();
+        smp_store_release(&ring->tail, head);
+        return;
+    }
+
+    for (; tail != head; tail++) {
+        cmd = &ring->cmds[tail % LED_RING_ENTRIES];
+        set = READ_ONCE(cmd->set);
+        clear = READ_ONCE(cmd->clear);
+        toggle = READ_ONCE(cmd->toggle);
+
+        if ((set & clear) || (set & toggle) || (clear & toggle) ||
+            !gpio_pins_managed(set | clear | toggle)) {
+            WRITE_ONCE(ring->rejected, ring->rejected + 1);
+            led_stats_rejected();
+            continue;
+        }
+
+        led_stats_command(set | clear | toggle);
+        fold.mask = set;
+        fold.action = LED_ACTION_ON;
+        led_update_add(&update, &fold);
+        fold.mask = clear;
+        fold.action = LED_ACTION_OFF;
+        led_update_add(&update, &fold);
+        fold.mask = toggle;
+        fold.action = LED_ACTION_TOGGLE;
+        led_update_add(&update, &fold);
+    }
+
+    apply_update(&update);
+
+    // Entries up to head may be reused by the producer from now on
+    smp_store_release(&ring->tail, head);
+}
+
+static void led_ring_drain_all(void) {
+    struct led_client *client;
+
+    mutex_lock(&ring_mutex);
+    list_for_each_entry(client, &ring_clients, ring_node) {
+        led_ring_drain(client);
+    }
+    mutex_unlock(&ring_mutex);
+}
+
+/* Called with ring_lock held */
+static bool led_ring_pending(void) {
+    struct led_client *client;
+
+    list_for_each_entry(client, &ring_clients, ring_node) {
+        if (READ_ONCE(client->ring->head) != READ_ONCE(client->ring->tail)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Wakes the applier when a ring has new entries, runs while rings are mapped */
+static enum hrtimer_restart led_ring_timer_fn(struct hrtimer *timer) {
+    bool mapped, pending;
+
+    spin_lock(&ring_lock);
+    mapped = !list_empty(&ring_clients);
+    pending = led_ring_pending();
+    spin_unlock(&ring_lock);
+
+    if (pending) {
+        queue_work(led_wq, &led_apply_work);
+    }
+    if (!mapped) {
+        return HRTIMER_NORESTART;
+    }
+
+    hrtimer_forward_now(timer, us_to_ktime(ring_poll_us));
+    return HRTIMER_RESTART;
+}
+
+/*
+ * Level change hook of the core. Every blink edge, frame and applied batch
+ * passes through here, including the last edge of a finished pattern.
+ */
+static void led_notify_levels(u32 pins) {
+    atomic_inc(&led_events);
+    wake_up_interruptible_all(&led_event_wait);
+}
+
+/* Waits until everything this client has queued has reached the pins */
+static int led_client_wait_applied(struct led_client *client) {
+    return wait_event_interruptible(client->applied, !atomic_read(&client->pending));
+}
+
+static ssize_t handle_input(struct led_client *client, char *input, size_t len) {
+    struct led_update update;
+    struct hlist_head events;
+    struct led_cmd *cmds;
+    unsigned int count;
+    unsigned int i;
+    bool query;
+    ssize_t ret;
+    u64 now;
+    int err;
+
+    cmds = kmalloc_array(MAX_BATCH_CMDS, sizeof(*cmds), GFP_KERNEL);
+    if (!cmds) {
+        return -ENOMEM;
+    }
+
+    mutex_lock(&client->lock);
+    client->last_error[0] = '\0';
+    ret = parse_input(input, len, cmds, &count, client->last_error, ERROR_MSG_SIZE);
+    client->last_result = ret;
+    client->last_applied = count;
+    if (client->last_error[0]) {
+        WRITE_ONCE(client->error_pending, true);
+        wake_up_interruptible_all(&led_event_wait);
+    }
+
+    if (count) {
+        // Deadlines still ahead get their place in the wheel first, all or
+        // none, so a full wheel fails the write before any of its commands
+        // took effect. They are filed after the rest of the batch applied.
+        now = ktime_get_ns();
+        err = led_sched_reserve(client, cmds, count, now, &events);
+        if (err) {
+            client->last_result = err;
+            client->last_applied = 0;
+            snprintf(client->last_error, ERROR_MSG_SIZE, "%s\n",
+                     err == -ENOSPC ? "Too many scheduled events" : "Out of memory");
+            WRITE_ONCE(client->error_pending, true);
+            wake_up_interruptible_all(&led_event_wait);
+            ret = err;
+            goto out;
+        }
+
+        // Like fold_commands(), but level commands of a staging file go to
+        // its staging buffer and stage and commit act in batch order: the
+        // commands before a commit are queued ahead of it
+        memset(&update, 0, sizeof(update));
+        query = false;
+        for (i = 0; i < count; i++) {
+            led_stats_command(cmds[i].mask);
+
+            if (cmds[i].action == LED_ACTION_STAGE) {
+                client->staging = true;
+            } else if (cmds[i].action == LED_ACTION_COMMIT) {
+                // A query still reports the state after the whole batch
+                query |= update.query;
+                update.query = false;
+                if (led_queue_update(client, &update) || led_queue_commit(client)) {
+                    ret = -ENOMEM;
+                }
+                memset(&update, 0, sizeof(update));
+            } else if (client->staging && !cmds[i].at && led_action_stageable(cmds[i].action)) {
+                led_update_add(&client->stage, &cmds[i]);
+            } else if (cmds[i].at <= now) {
+                // Overdue timed commands apply at once, in batch order
+                if (cmds[i].at) {
+                    led_stats_sched_missed();
+                }
+                led_update_add(&update, &cmds[i]);
+            }
+        }
+
+        // Queued under the client lock, so batches of one file stay in order
+        update.query |= query;
+        if (led_queue_timed(client, &update, &events)) {
+            led_sched_unreserve(&events);
+            ret = -ENOMEM;
+        }
+    }
+out:
+    mutex_unlock(&client->lock);
+
+    kfree(cmds);
+
+    return ret;
+}
+
+/*
+ * Formats the status returned by read(), one "key: value" per line. The
+ * query line lists every managed pin in command syntax, "16:on;20:off".
+ */
+static int led_client_format_status(struct led_client *client) {
+    unsigned long bits = client->query_managed;
+    const char *sep = " ";
+    int len;
+    int pin;
+
+    len = scnprintf(client->status, STATUS_MSG_SIZE,
+                    "result: %zd\n"
+                    "applied: %u\n"
+                    "error: %s"
+                    "levels: 0x%08x\n",
+                    client->last_result, client->last_applied,
+                    client->last_error[0] ? client->last_error : "none\n",
+                    gpio_get_levels() & READ_ONCE(managed_pins));
+
+    if (!client->has_query) {
+        return len;
+    }
+
+    len += scnprintf(client->status + len, STATUS_MSG_SIZE - len, "query:");
+    for_each_set_bit(pin, &bits, GPIO_NUM_PINS) {
+        len += scnprintf(client->status + len, STATUS_MSG_SIZE - len, "%s%d:%s", sep, pin,
+                         client->query_levels & BIT(pin) ? "on" : "off");
+        sep = ";";
+    }
+    len += scnprintf(client->status + len, STATUS_MSG_SIZE - len, "\n");
+
+    return len;
+}
+
+static int led_ctrl_dev_open(struct inode *inodep, struct file *filep) {
+    struct led_client *client;
+
+    client = kzalloc(sizeof(*client), GFP_KERNEL);
+    if (!client) {
+        return -ENOMEM;
+    }
+    mutex_init(&client->lock);
+    atomic_set(&client->pending, 0);
+    init_waitqueue_head(&client->applied);
+    INIT_LIST_HEAD(&client->sched_events);
+    client->events_seen = atomic_read(&led_events);
+    filep->private_data = client;
+
+    printk(KERN_INFO "LED Control device opened\n");
+    return 0;
+}
+
+/*
+ * Readable once pin levels have changed since the client last read its
+ * status, which includes a pattern running to completion. A new error
+ * from write() is also flagged as priority data. Writes never block.
+ */
+static __poll_t led_ctrl_dev_poll(struct file *filep, poll_table *wait) {
+    struct led_client *client = filep->private_data;
+    __poll_t mask = EPOLLOUT | EPOLLWRNORM;
+
+    poll_wait(filep, &led_event_wait, wait);
+
+    if (atomic_read(&led_events) != READ_ONCE(client->events_seen)) {
+        mask |= EPOLLIN | EPOLLRDNORM;
+    }
+    if (READ_ONCE(client->error_pending)) {
+        mask |= EPOLLIN | EPOLLRDNORM | EPOLLPRI;
+    }
+    if (led_client_frame_out(client)) {
+        mask |= EPOLLIN | EPOLLRDBAND;
+    }
+    return mask;
+}
+
+static int led_ctrl_dev_release(struct inode *inodep, struct file *filep) {
+    struct led_client *client = filep->private_data;
+    unsigned long flags;
+
+    if (client->ring) {
+        mutex_lock(&ring_mutex);
+        spin_lock_irqsave(&ring_lock, flags);
+        list_del(&client->ring_node);
+        spin_unlock_irqrestore(&ring_lock, flags);
+        mutex_unlock(&ring_mutex);
+    }
+
+    // Queued batches still point at the client and may file its events
+    flush_work(&led_apply_work);
+    led_sched_cancel_all(client);
+    vfree(client->ring);
+    kfree(client);
+
+    printk(KERN_INFO "LED Control device closed\n");
+    return 0;
+}
+
+/* Offset 0 maps the client's command ring, LED_MMAP_FRAME_OFFSET the desired state */
+static int led_ctrl_dev_mmap(struct file *filep, struct vm_area_struct *vma) {
+    if (vma->vm_pgoff == 0) {
+        return led_ring_mmap(filep->private_data, vma);
+    }
+    if (vma->vm_pgoff == LED_MMAP_FRAME_OFFSET >> PAGE_SHIFT) {
+        return led_frame_mmap(vma);
+    }
+    return -EINVAL;
+}
+
+/*
+ * Maps the client's command ring, see struct led_ring. The ring is created
+ * on the first mmap() and stays registered until the file is closed.
+ */
+static int led_ring_mmap(struct led_client *client, struct vm_area_struct *vma) {
+    unsigned long flags;
+    int ret = 0;
+
+    if (vma_pages(vma) > PAGE_ALIGN(sizeof(struct led_ring)) >> PAGE_SHIFT) {
+        return -EINVAL;
+    }
+
+    mutex_lock(&client->lock);
+    if (!client->ring) {
+        client->ring = vmalloc_user(sizeof(struct led_ring));
+        if (!client->ring) {
+            ret = -ENOMEM;
+            goto out;
+        }
+
+        mutex_lock(&ring_mutex);
+        spin_lock_irqsave(&ring_lock, flags);
+        list_add_tail(&client->ring_node, &ring_clients);
+        if (ring_poll_us) {
+            hrtimer_start(&ring_timer, us_to_ktime(ring_poll_us), HRTIMER_MODE_REL);
+        }
+        spin_unlock_irqrestore(&ring_lock, flags);
+        mutex_unlock(&ring_mutex);
+    }
+
+    ret = remap_vmalloc_range(vma, client->ring, 0);
+
+out:
+    mutex_unlock(&client->lock);
+    return ret;
+}
+
+static int led_frame_mmap(struct vm_area_struct *vma) {
+    int ret;
+
+    if (vma_pages(vma) > PAGE_ALIGN(sizeof(struct led_frame)) >> PAGE_SHIFT) {
+        return -EINVAL;
+    }
+
+    ret = remap_vmalloc_range(vma, led_frame, 0);
+    if (ret) {
+        return ret;
+    }
+
+    vma->vm_ops = &led_frame_vm_ops;
+    led_frame_vm_open(vma);
+    return 0;
+}
+
+static void led_frame_vm_open(struct vm_area_struct *vma) {
+    mutex_lock(&frame_mutex);
+    if (frame_maps++ == 0) {
+        // Make the first sample apply whatever the page holds
+        frame_seq = READ_ONCE(led_frame->seq) - 2;
+        hrtimer_start(&frame_timer, led_frame_period(), HRTIMER_MODE_REL);
+    }
+    mutex_unlock(&frame_mutex);
+}
+
+/* The frame timer stops by itself once nothing maps the page or commits */
+static void led_frame_vm_close(struct vm_area_struct *vma) {
+    mutex_lock(&frame_mutex);
+    frame_maps--;
+    mutex_unlock(&frame_mutex);
+}
+
+static ktime_t led_frame_period(void) {
+    unsigned int rate = clamp(READ_ONCE(frame_rate_hz), 1U, FRAME_RATE_MAX);
+
+    return ns_to_ktime(NSEC_PER_SEC / rate);
+}
+
+/*
+ * Applies the desired state page, if a new consistent frame is there, and
+ * the commits since the last frame on top of it, as one GPCLR0/GPSET0
+ * update.
+ */
+static enum hrtimer_restart led_frame_timer_fn(struct hrtimer *timer) {
+    struct led_update update = { 0 };
+    struct led_cmd cmd = { 0 };
+    u32 seq, levels, mask;
+    bool committed;
+    u32 frame = 0;
+
+    seq = smp_load_acquire(&led_frame->seq);
+    if (!(seq & 1) && seq != frame_seq) {
+        levels = READ_ONCE(led_frame->levels);
+        mask = READ_ONCE(led_frame->mask) & READ_ONCE(managed_pins);
+        smp_rmb();
+
+        // Torn by a concurrent writer, the next frame picks it up
+        if (READ_ONCE(led_frame->seq) == seq) {
+            frame_seq = seq;
+            cmd.action = LED_ACTION_ON;
+            cmd.mask = levels & mask;
+            led_update_add(&update, &cmd);
+            cmd.action = LED_ACTION_OFF;
+            cmd.mask = ~levels & mask;
+            led_update_add(&update, &cmd);
+        }
+    }
+
+    spin_lock(&commit_lock);
+    committed = commit_pending;
+    if (committed) {
+        led_update_merge(&update, &frame_commit);
+        memset(&frame_commit, 0, sizeof(frame_commit));
+        WRITE_ONCE(commit_pending, false);
+        frame = ++frames_taken;
+    }
+    spin_unlock(&commit_lock);
+
+    // Committed pins may have been released since their commit
+    mask = READ_ONCE(managed_pins);
+    gpio_update_mask_toggle(update.set & mask, update.clear & mask, update.toggle & mask);
+
+    if (committed) {
+        // Tell the committers their frame is out, even if no level changed
+        smp_store_release(&frames_out, frame);
+        wake_up_interruptible_all(&led_event_wait);
+    }
+
+    // led_frame_commit() may have requeued the timer meanwhile
+    if (hrtimer_is_queued(timer) || (!READ_ONCE(frame_maps) && !READ_ONCE(commit_pending))) {
+        return HRTIMER_NORESTART;
+    }
+    hrtimer_forward_now(timer, led_frame_period());
+    return HRTIMER_RESTART;
+}
+
+/* Folds the level changes of levels into update, as if applied after it */
+static void led_update_merge(struct led_update *update, const struct led_update *levels) {
+    struct led_cmd cmd = { 0 };
+
+    cmd.action = LED_ACTION_ON;
+    cmd.mask = levels->set;
+    led_update_add(update, &cmd);
+    cmd.action = LED_ACTION_OFF;
+    cmd.mask = levels->clear;
+    led_update_add(update, &cmd);
+    cmd.action = LED_ACTION_TOGGLE;
+    cmd.mask = levels->toggle;
+    led_update_add(update, &cmd);
+}
+
+/* Blink, PWM and queries take effect at once even while staging */
+static bool led_action_stageable(enum led_action action) {
+    return action == LED_ACTION_ON || action == LED_ACTION_OFF || action == LED_ACTION_TOGGLE;
+}
+
+/* True once the frame carrying the last commit of client has gone out */
+static bool led_client_frame_out(struct led_client *client) {
+    return READ_ONCE(client->commit_waiting) &&
+           (s32)(smp_load_acquire(&frames_out) - READ_ONCE(client->commit_frame)) >= 0;
+}
+
+/*
+ * Hands a committed staging buffer of client to the next frame. Commits
+ * of several files before the same frame go out together, a later one
+ * winning on pins both touch. Called by the applier with the client lock
+ * held.
+ */
+static void led_frame_commit(struct led_client *client, const struct led_update *stage) {
+    unsigned long flags;
+
+    spin_lock_irqsave(&commit_lock, flags);
+    led_update_merge(&frame_commit, stage);
+    WRITE_ONCE(commit_pending, true);
+    WRITE_ONCE(client->commit_frame, frames_taken + 1);
+    WRITE_ONCE(client->commit_waiting, true);
+    spin_unlock_irqrestore(&commit_lock, flags);
+
+    if (!hrtimer_is_queued(&frame_timer)) {
+        hrtimer_start(&frame_timer, led_frame_period(), HRTIMER_MODE_REL);
+    }
+}
+
+static ssize_t led_ctrl_dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset) {
+    struct led_client *client = filep->private_data;
+    ssize_t ret = 0;
+
+    // Reading from the start takes a fresh snapshot of the status, after
+    // the previous writes on this file have been applied
+    if (*offset == 0 && led_client_wait_applied(client)) {
+        return -ERESTARTSYS;
+    }
+
+    mutex_lock(&client->lock);
+
+    // Everything up to this snapshot counts as seen by poll()
+    if (*offset == 0) {
+        WRITE_ONCE(client->events_seen, atomic_read(&led_events));
+        WRITE_ONCE(client->error_pending, false);
+        if (led_client_frame_out(client)) {
+            WRITE_ONCE(client->commit_waiting, false);
+        }
+        client->status_len = led_client_format_status(client);
+    }
+
+    // End of file, the next read starts over with a new snapshot
+    if (*offset >= client->status_len) {
+        *offset = 0;
+        goto out;
+    }
+
+    if (len > client->status_len - *offset) {
+        len = client->status_len - *offset;
+    }
+
+    if (copy_to_user(buffer, client->status + *offset, len)) {
+        ret = -EFAULT;
+        goto out;
+    }
+
+    *offset += len;
+    ret = len;
+
+out:
+    mutex_unlock(&client->lock);
+    return ret;
+}
+
+static ssize_t led_ctrl_dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset) {
+    bool truncated = len > WRITE_MAX_SIZE;
+    u64 start = ktime_get_ns();
+    char *input;
+    ssize_t ret;
+
+    if (truncated) {
+        len = WRITE_MAX_SIZE;
+    }
+
+    input = memdup_user_nul(buffer, len);
+    if (IS_ERR(input)) {
+        return PTR_ERR(input);
+    }
+
+    // A truncated write may end in the middle of a command. Only consume
+    // up to the last separator so the caller resends the remainder.
+    if (truncated) {
+        char *sep = input + len;
+
+        while (sep > input && !strchr(CMD_SEPARATORS, sep[-1])) {
+            sep--;
+        }
+        if (sep > input) {
+            len = sep - input;
+            input[len] = '\0';
+        }
+    }
+
+    ret = handle_input(filep->private_data, input, len);
+    kfree(input);
+
+    led_stats_latency(ktime_get_ns() - start);
+
+    return ret;
+}
+
+static long led_ctrl_dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg) {
+    long ret;
+
+    ret = led_ctrl_do_ioctl(filep->private_data, cmd, (void __user *)arg);
+    if (ret == -EINVAL) {
+        led_stats_rejected();
+    }
+    return ret;
+}
+
+static long led_ctrl_do_ioctl(struct led_client *client, unsigned int cmd, void __user *argp) {
+    struct led_update update = { 0 };
+
+    switch (cmd) {
+    case LED_IOC_SET:
+    case LED_IOC_CLEAR:
+    case LED_IOC_TOGGLE: {
+        struct led_pin req;
+
+        if (copy_from_user(&req, argp, sizeof(req))) {
+            return -EFAULT;
+        }
+        if (req.pin >= GPIO_NUM_PINS || !gpio_pins_managed(BIT(req.pin))) {
+            return -EINVAL;
+        }
+
+        led_stats_command(BIT(req.pin));
+        if (cmd == LED_IOC_SET) {
+            update.set = BIT(req.pin);
+        } else if (cmd == LED_IOC_CLEAR) {
+            update.clear = BIT(req.pin);
+        } else {
+            update.toggle = BIT(req.pin);
+        }
+        return led_queue_update(client, &update);
+    }
+    case LED_IOC_SET_MASK: {
+        struct led_mask mask;
+
+        if (copy_from_user(&mask, argp, sizeof(mask))) {
+            return -EFAULT;
+        }
+        if ((mask.set & mask.clear) || (mask.set & mask.toggle) || (mask.clear & mask.toggle) ||
+            !gpio_pins_managed(mask.set | mask.clear | mask.toggle)) {
+            return -EINVAL;
+        }
+        led_stats_command(mask.set | mask.clear | mask.toggle);
+        update.set = mask.set;
+        update.clear = mask.clear;
+        update.toggle = mask.toggle;
+        return led_queue_update(client, &update);
+    }
+    case LED_IOC_GET_STATE: {
+        struct led_state state;
+
+        if (led_client_wait_applied(client)) {
+            return -ERESTARTSYS;
+        }
+
+        state.managed = READ_ONCE(managed_pins);
+        state.levels = gpio_get_levels() & state.managed;
+        state.blinking = (led_pattern_active_mask() | READ_ONCE(blink_sched.active)) &
+                         state.managed;
+
+        if (copy_to_user(argp, &state, sizeof(state))) {
+            return -EFAULT;
+        }
+        return 0;
+    }
+    case LED_IOC_RESYNC:
+        gpio_resync();
+        return 0;
+    case LED_IOC_SET_PWM: {
+        struct led_pwm pwm;
+        struct led_cmd fold;
+
+        if (copy_from_user(&pwm, argp, sizeof(pwm))) {
+            return -EFAULT;
+        }
+        if (pwm.pin >= GPIO_NUM_PINS || !gpio_pins_managed(BIT(pwm.pin)) ||
+            pwm.duty > PWM_DUTY_MAX || !pwm.freq_hz || pwm.freq_hz > PWM_FREQ_MAX) {
+            return -EINVAL;
+        }
+
+        fold.mask = BIT(pwm.pin);
+        fold.action = LED_ACTION_PWM;
+        fold.args[0] = pwm.duty;
+        fold.args[1] = pwm.freq_hz;
+        led_stats_command(fold.mask);
+        led_update_add(&update, &fold);
+        return led_queue_update(client, &update);
+    }
+    case LED_IOC_PLAY_TIMELINE: {
+        struct led_timeline timeline;
+        struct led_keyframe *frames;
+        int ret;
+
+        if (copy_from_user(&timeline, argp, sizeof(timeline))) {
+            return -EFAULT;
+        }
+        if (!timeline.count || timeline.count > LED_TIMELINE_MAX_FRAMES) {
+            return -EINVAL;
+        }
+
+        frames = memdup_user(u64_to_user_ptr(timeline.frames),
+                             timeline.count * sizeof(*frames));
+        if (IS_ERR(frames)) {
+            return PTR_ERR(frames);
+        }
+        if (led_timeline_check(&timeline, frames)) {
+            kfree(frames);
+            return -EINVAL;
+        }
+
+        led_stats_command(led_timeline_pins(frames, timeline.count));
+        ret = led_queue_timeline(client, &timeline, frames);
+        if (ret) {
+            kfree(frames);
+        }
+        return ret;
+    }
+    case LED_IOC_LOAD_PROGRAM: {
+        struct led_program program;
+        struct led_insn *insns;
+        int ret;
+
+        if (copy_from_user(&program, argp, sizeof(program))) {
+            return -EFAULT;
+        }
+        if (!program.count || program.count > LED_PROGRAM_MAX_INSNS || program.reserved) {
+            return -EINVAL;
+        }
+
+        insns = memdup_user(u64_to_user_ptr(program.insns), program.count * sizeof(*insns));
+        if (IS_ERR(insns)) {
+            return PTR_ERR(insns);
+        }
+        if (led_program_check(insns, program.count)) {
+            kfree(insns);
+            return -EINVAL;
+        }
+
+        led_stats_command(led_program_pins(insns, program.count));
+        ret = led_queue_program(client, insns, program.count);
+        if (ret) {
+            kfree(insns);
+        }
+        return ret;
+    }
+    case LED_IOC_SCHEDULE: {
+        struct led_sched_event event;
+        struct led_update update;
+        u64 now;
+
+        if (copy_from_user(&event, argp, sizeof(event))) {
+            return -EFAULT;
+        }
+        if ((event.flags & ~LED_SCHED_ABSOLUTE) || event.reserved ||
+            !(event.set | event.clear) || (event.set & event.clear) ||
+            !gpio_pins_managed(event.set | event.clear)) {
+            return -EINVAL;
+        }
+        now = ktime_get_ns();
+        if (!(event.flags & LED_SCHED_ABSOLUTE)) {
+            // A delay that wraps would look overdue
+            if (event.time_ns > U64_MAX - now) {
+                return -EINVAL;
+            }
+            event.time_ns += now;
+        }
+
+        led_stats_command(event.set | event.clear);
+
+        // Already due: applied at once, after the earlier commands of the file
+        if (event.time_ns <= now) {
+            led_stats_sched_missed();
+            memset(&update, 0, sizeof(update));
+            update.set = event.set;
+            update.clear = event.clear;
+            return led_queue_update(client, &update);
+        }
+        return led_sched_add(client, event.time_ns, event.set, event.clear, &event.id);
+    }
+    case LED_IOC_UNSCHEDULE: {
+        u64 id;
+
+        if (copy_from_user(&id, argp, sizeof(id))) {
+            return -EFAULT;
+        }
+        return led_sched_cancel(client, id);
+    }
+    case LED_IOC_RING_KICK:
+        if (!client->ring) {
+            return -EINVAL;
+        }
+        queue_work(led_wq, &led_apply_work);
+        return 0;
+    case LED_IOC_START_PATTERN: {
+        struct led_pattern pattern;
+        struct led_cmd blink;
+
+        if (copy_from_user(&pattern, argp, sizeof(pattern))) {
+            return -EFAULT;
+        }
+        if (pattern.pin >= GPIO_NUM_PINS || !gpio_pins_managed(BIT(pattern.pin)) ||
+            pattern.duration_ms > INT_MAX) {
+            return -EINVAL;
+        }
+
+        // Default blink for the duration, at least one cycle
+        blink.mask = BIT(pattern.pin);
+        blink.action = LED_ACTION_BLINK;
+        blink.args[0] = BLINK_PERIOD_MS;
+        blink.args[1] = BLINK_DUTY_PCT;
+        blink.args[2] = max(pattern.duration_ms / BLINK_PERIOD_MS, 1U);
+        led_update_add(&update, &blink);
+
+        led_stats_command(blink.mask);
+        return led_queue_update(client, &update);
+    }
+    default:
+        return -ENOTTY;
+    }
+}
+
+static ssize_t managed_pins_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    unsigned long bits = READ_ONCE(managed_pins);
+
+    return sysfs_emit(buf, "%*pbl\n", GPIO_NUM_PINS, &bits);
+}
+
+/*
+ * Replaces the managed pin set with a list such as "16,20-23". New pins
+ * are configured as outputs, dropped pins are stopped and driven low.
+ */
+static ssize_t managed_pins_store(struct device *dev, struct device_attribute *attr,
+                                  const char *buf, size_t count) {
+    DECLARE_BITMAP(bits, GPIO_NUM_PINS);
+    u32 mask, removed;
+    int ret;
+
+    ret = bitmap_parselist(buf, bits, GPIO_NUM_PINS);
+    if (ret) {
+        return ret;
+    }
+    mask = bits[0];
+
+    mutex_lock(&blink_lock);
+    removed = managed_pins & ~mask;
+    led_pattern_stop_mask(removed);
+    led_blink_stop(removed);
+    led_pwm_stop(removed);
+    gpio_update_mask(0, removed);
+    set_gpio_direction_out_mask(mask & ~managed_pins);
+    WRITE_ONCE(managed_pins, mask);
+    mutex_unlock(&blink_lock);
+
+    return count;
+}
+
+static ssize_t commands_accepted_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(commands_accepted));
+}
+
+static ssize_t commands_rejected_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(commands_rejected));
+}
+
+static ssize_t mmio_writes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(mmio_writes));
+}
+
+static ssize_t blink_cycles_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(blink_cycles));
+}
+
+static ssize_t elided_writes_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(elided_writes));
+}
+
+static ssize_t pwm_edges_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(pwm_edges));
+}
+
+static ssize_t sched_fired_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(sched_fired));
+}
+
+static ssize_t sched_missed_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    return sysfs_emit(buf, "%llu\n", led_stats_read(sched_missed));
+}
+
+/*
+ * One line per pin that has seen any activity:
+ * pin commands mmio_writes blink_cycles elided
+ */
+static ssize_t pins_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    u64 commands, mmio_writes, blink_cycles, elided;
+    int len = 0;
+    int pin;
+
+    for (pin = 0; pin < GPIO_NUM_PINS; pin++) {
+        commands = led_stats_read(pin_commands[pin]);
+        mmio_writes = led_stats_read(pin_mmio_writes[pin]);
+        blink_cycles = led_stats_read(pin_blink_cycles[pin]);
+        elided = led_stats_read(pin_elided[pin]);
+
+        if (commands || mmio_writes || blink_cycles || elided) {
+            len += sysfs_emit_at(buf, len, "%d %llu %llu %llu %llu\n", pin,
+                                 commands, mmio_writes, blink_cycles, elided);
+        }
+    }
+    return len;
+}
+
+/* One line per log2 bucket: upper bound in ns and number of write() calls */
+static ssize_t latency_hist_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int len = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+        len += sysfs_emit_at(buf, len, "%llu %llu\n", 1ULL << bucket,
+                             led_stats_read(latency_hist[bucket]));
+    }
+    return len;
+}
+
+/* One line per log2 bucket: upper bound in ns and number of late PWM timer runs */
+static ssize_t pwm_jitter_hist_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int len = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+        len += sysfs_emit_at(buf, len, "%llu %llu\n", 1ULL << bucket,
+                             led_stats_read(pwm_jitter_hist[bucket]));
+    }
+    return len;
+}
+
+/* One line per log2 bucket: upper bound in ns and number of scheduled events that late */
+static ssize_t sched_late_hist_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    int len = 0;
+    int bucket;
+
+    for (bucket = 0; bucket < STATS_LATENCY_BUCKETS; bucket++) {
+        len += sysfs_emit_at(buf, len, "%llu %llu\n", 1ULL << bucket,
+                             led_stats_read(sched_late_hist[bucket]));
+    }
+    return len;
+}
+
+module_init(led_ctrl_init);
+module_exit(led_ctrl_exit);
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("vilmursss");
+MODULE_DESCRIPTION("A simple Linux char driver for controlling LEDs in Raspberry Pi 3 output pins");
+MODULE_VERSION("0.1");
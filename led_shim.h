@@ -0,0 +1,145 @@
+/*
+ * Userspace stand-ins for the kernel APIs used by led_core.c, so the core
+ * can be built into tools that run without the module.
+ */
+#ifndef LED_SHIM_H
+#define LED_SHIM_H
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+
+#define BIT(nr) (1UL << (nr))
+#define BIT_ULL(nr) (1ULL << (nr))
+#define U32_MAX UINT32_MAX
+#define U64_MAX UINT64_MAX
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_USEC 1000L
+#define USEC_PER_MSEC 1000L
+#define NSEC_PER_MSEC 1000000L
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+
+#define __ffs(x) ((unsigned long)__builtin_ctzl(x))
+#define __ffs64(x) ((unsigned long)__builtin_ctzll(x))
+#define fls64(x) ((x) ? 64 - __builtin_clzll(x) : 0)
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+static inline u64 ror64(u64 word, unsigned int shift) {
+    return (word >> (shift & 63)) | (word << ((-shift) & 63));
+}
+
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+// MMIO on the simulated register block is plain memory access
+static inline u32 ioread32(const volatile void *addr) {
+    return *(const volatile u32 *)addr;
+}
+
+static inline void iowrite32(u32 value, volatile void *addr) {
+    *(volatile u32 *)addr = value;
+}
+
+// Userspace tools are single threaded, locks compile away
+typedef int spinlock_t;
+#define DEFINE_SPINLOCK(name) spinlock_t name = 0
+#define spin_lock_irqsave(lock, flags) ((void)(lock), (void)(flags))
+#define spin_unlock_irqrestore(lock, flags) ((void)(lock), (void)(flags))
+
+// A single CPU: per-CPU variables are plain globals
+#define DECLARE_PER_CPU(type, name) extern __typeof__(type) name
+#define DEFINE_PER_CPU(type, name) __typeof__(type) name
+#define per_cpu(var, cpu) (*((void)(cpu), &(var)))
+#define this_cpu_inc(var) ((var)++)
+#define this_cpu_add(var, val) ((var) += (val))
+#define for_each_possible_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+
+// Tracepoints only exist in the kernel
+#define trace_led_command(mask, action) do { } while (0)
+#define trace_led_gpio_write(offset, value) do { } while (0)
+#define trace_led_direction_out(offset, pins, fsel) do { } while (0)
+#define trace_led_timeline_start(pins, frames, mode, loops) do { } while (0)
+#define trace_led_timeline_stop(pins, completed) do { } while (0)
+#define trace_led_blink_start(pins, period_ms, duty_pct, count) do { } while (0)
+#define trace_led_blink_stop(pins, completed) do { } while (0)
+#define trace_led_program_start(pins, insns) do { } while (0)
+#define trace_led_program_stop(pins, completed) do { } while (0)
+
+static inline u64 div64_u64_rem(u64 dividend, u64 divisor, u64 *remainder) {
+    *remainder = dividend % divisor;
+    return dividend / divisor;
+}
+
+// Doubly linked lists with a single pointer head, as in <linux/list.h>
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+#define INIT_HLIST_HEAD(head) ((head)->first = NULL)
+#define hlist_empty(head) (!(head)->first)
+#define hlist_unhashed(node) (!(node)->pprev)
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+#define hlist_entry_safe(ptr, type, member) \
+    ((ptr) ? container_of(ptr, type, member) : NULL)
+#define hlist_for_each_entry_safe(pos, n, head, member) \
+    for (pos = hlist_entry_safe((head)->first, __typeof__(*pos), member); \
+         pos && ((n = pos->member.next), 1); \
+         pos = hlist_entry_safe(n, __typeof__(*pos), member))
+
+static inline void hlist_add_head(struct hlist_node *node, struct hlist_head *head) {
+    node->next = head->first;
+    if (head->first) {
+        head->first->pprev = &node->next;
+    }
+    head->first = node;
+    node->pprev = &head->first;
+}
+
+static inline void hlist_del_init(struct hlist_node *node) {
+    if (hlist_unhashed(node)) {
+        return;
+    }
+    *node->pprev = node->next;
+    if (node->next) {
+        node->next->pprev = node->pprev;
+    }
+    node->next = NULL;
+    node->pprev = NULL;
+}
+
+static inline void hlist_move_list(struct hlist_head *old, struct hlist_head *new) {
+    new->first = old->first;
+    if (new->first) {
+        new->first->pprev = &new->first;
+    }
+    old->first = NULL;
+}
+
+static inline char *strim(char *s) {
+    size_t len = strlen(s);
+
+    while (len && isspace((unsigned char)s[len - 1])) {
+        s[--len] = '\0';
+    }
+    while (isspace((unsigned char)*s)) {
+        s++;
+    }
+    return s;
+}
+
+#endif /* LED_SHIM_H */
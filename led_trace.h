@@ -0,0 +1,196 @@
+/*
+ * Tracepoints of the LED control driver, enabled through
+ * /sys/kernel/tracing/events/led_control/.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM led_control
+
+#if !defined(_LED_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LED_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "led_core.h"
+
+TRACE_DEFINE_ENUM(LED_ACTION_ON);
+TRACE_DEFINE_ENUM(LED_ACTION_OFF);
+TRACE_DEFINE_ENUM(LED_ACTION_BLINK);
+TRACE_DEFINE_ENUM(LED_ACTION_TOGGLE);
+TRACE_DEFINE_ENUM(LED_ACTION_QUERY);
+TRACE_DEFINE_ENUM(LED_ACTION_PWM);
+TRACE_DEFINE_ENUM(LED_ACTION_STAGE);
+TRACE_DEFINE_ENUM(LED_ACTION_COMMIT);
+TRACE_DEFINE_ENUM(LED_TIMELINE_ONCE);
+TRACE_DEFINE_ENUM(LED_TIMELINE_LOOP);
+TRACE_DEFINE_ENUM(LED_TIMELINE_PINGPONG);
+
+#define show_led_action(action)                  \
+    __print_symbolic(action,                     \
+        { LED_ACTION_ON, "on" },                 \
+        { LED_ACTION_OFF, "off" },               \
+        { LED_ACTION_BLINK, "blink" },           \
+        { LED_ACTION_TOGGLE, "toggle" },         \
+        { LED_ACTION_QUERY, "query" },           \
+        { LED_ACTION_PWM, "pwm" },               \
+        { LED_ACTION_STAGE, "stage" },           \
+        { LED_ACTION_COMMIT, "commit" })
+
+/* A text command has been parsed */
+TRACE_EVENT(led_command,
+    TP_PROTO(u32 mask, enum led_action action),
+    TP_ARGS(mask, action),
+    TP_STRUCT__entry(
+        __field(u32, mask)
+        __field(int, action)
+    ),
+    TP_fast_assign(
+        __entry->mask = mask;
+        __entry->action = action;
+    ),
+    TP_printk("mask=0x%08x action=%s", __entry->mask, show_led_action(__entry->action))
+);
+
+/* A GPIO register is written, offset is relative to the GPIO block */
+TRACE_EVENT(led_gpio_write,
+    TP_PROTO(unsigned int offset, u32 value),
+    TP_ARGS(offset, value),
+    TP_STRUCT__entry(
+        __field(unsigned int, offset)
+        __field(u32, value)
+    ),
+    TP_fast_assign(
+        __entry->offset = offset;
+        __entry->value = value;
+    ),
+    TP_printk("offset=0x%02x value=0x%08x", __entry->offset, __entry->value)
+);
+
+/* Pins in one GPFSEL register are configured as outputs */
+TRACE_EVENT(led_direction_out,
+    TP_PROTO(unsigned int offset, u32 pins, u32 fsel),
+    TP_ARGS(offset, pins, fsel),
+    TP_STRUCT__entry(
+        __field(unsigned int, offset)
+        __field(u32, pins)
+        __field(u32, fsel)
+    ),
+    TP_fast_assign(
+        __entry->offset = offset;
+        __entry->pins = pins;
+        __entry->fsel = fsel;
+    ),
+    TP_printk("offset=0x%02x pins=0x%08x fsel=0x%08x",
+              __entry->offset, __entry->pins, __entry->fsel)
+);
+
+/* A timeline starts playing */
+TRACE_EVENT(led_timeline_start,
+    TP_PROTO(u32 pins, unsigned int frames, u32 mode, u32 loops),
+    TP_ARGS(pins, frames, mode, loops),
+    TP_STRUCT__entry(
+        __field(u32, pins)
+        __field(unsigned int, frames)
+        __field(u32, mode)
+        __field(u32, loops)
+    ),
+    TP_fast_assign(
+        __entry->pins = pins;
+        __entry->frames = frames;
+        __entry->mode = mode;
+        __entry->loops = loops;
+    ),
+    TP_printk("pins=0x%08x frames=%u mode=%s loops=%u", __entry->pins, __entry->frames,
+              __print_symbolic(__entry->mode,
+                  { LED_TIMELINE_ONCE, "once" },
+                  { LED_TIMELINE_LOOP, "loop" },
+                  { LED_TIMELINE_PINGPONG, "pingpong" }),
+              __entry->loops)
+);
+
+/* A timeline has run to completion or has been cancelled */
+TRACE_EVENT(led_timeline_stop,
+    TP_PROTO(u32 pins, bool completed),
+    TP_ARGS(pins, completed),
+    TP_STRUCT__entry(
+        __field(u32, pins)
+        __field(bool, completed)
+    ),
+    TP_fast_assign(
+        __entry->pins = pins;
+        __entry->completed = completed;
+    ),
+    TP_printk("pins=0x%08x %s", __entry->pins, __entry->completed ? "completed" : "cancelled")
+);
+
+/* A pin starts blinking on the shared blink tick, count 0 is endless */
+TRACE_EVENT(led_blink_start,
+    TP_PROTO(u32 pins, unsigned int period_ms, unsigned int duty_pct, unsigned int count),
+    TP_ARGS(pins, period_ms, duty_pct, count),
+    TP_STRUCT__entry(
+        __field(u32, pins)
+        __field(unsigned int, period_ms)
+        __field(unsigned int, duty_pct)
+        __field(unsigned int, count)
+    ),
+    TP_fast_assign(
+        __entry->pins = pins;
+        __entry->period_ms = period_ms;
+        __entry->duty_pct = duty_pct;
+        __entry->count = count;
+    ),
+    TP_printk("pins=0x%08x period=%ums duty=%u%% count=%u", __entry->pins,
+              __entry->period_ms, __entry->duty_pct, __entry->count)
+);
+
+/* Blinking pins have run their count of cycles or have been cancelled */
+TRACE_EVENT(led_blink_stop,
+    TP_PROTO(u32 pins, bool completed),
+    TP_ARGS(pins, completed),
+    TP_STRUCT__entry(
+        __field(u32, pins)
+        __field(bool, completed)
+    ),
+    TP_fast_assign(
+        __entry->pins = pins;
+        __entry->completed = completed;
+    ),
+    TP_printk("pins=0x%08x %s", __entry->pins, __entry->completed ? "completed" : "cancelled")
+);
+
+/* A pattern program starts running */
+TRACE_EVENT(led_program_start,
+    TP_PROTO(u32 pins, unsigned int insns),
+    TP_ARGS(pins, insns),
+    TP_STRUCT__entry(
+        __field(u32, pins)
+        __field(unsigned int, insns)
+    ),
+    TP_fast_assign(
+        __entry->pins = pins;
+        __entry->insns = insns;
+    ),
+    TP_printk("pins=0x%08x insns=%u", __entry->pins, __entry->insns)
+);
+
+/* A pattern program has reached END or has been cancelled */
+TRACE_EVENT(led_program_stop,
+    TP_PROTO(u32 pins, bool completed),
+    TP_ARGS(pins, completed),
+    TP_STRUCT__entry(
+        __field(u32, pins)
+        __field(bool, completed)
+    ),
+    TP_fast_assign(
+        __entry->pins = pins;
+        __entry->completed = completed;
+    ),
+    TP_printk("pins=0x%08x %s", __entry->pins, __entry->completed ? "completed" : "cancelled")
+);
+
+#endif /* _LED_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE led_trace
+#include <trace/define_trace.h>